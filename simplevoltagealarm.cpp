@@ -22,20 +22,77 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <iomanip>
 #include <string>
 #include <cstring>
 #include <vector>
+#include <memory>
+#include <map>
+#include <deque>
+#include <algorithm>
 #include <cmath>
+#include <cerrno>
 #include <thread>
+#include <atomic>
+#include <limits>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <iterator>
+#include <cstddef>
+#include <csignal>
 
 #include "pthread.h"
 #include "unistd.h"
+#include "fcntl.h"
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sched.h>
+#include <netdb.h>
+#include <linux/netlink.h>
+#include <sys/syscall.h>
+// io_uring (IOUring) needs the headers of Linux 5.6 (IORING_OP_READ) at build time, else pread() is always used
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup) //both since 5.6
+#define SBVA_IO_URING
+#endif
+#include "poll.h"
 #include "dirent.h"
+#include "syslog.h"
+#include "pwd.h"
 
 using namespace std;
 
+// allocations are counted only in benchmark mode (-b), which sets count_allocations. otherwise it costs
+// a test of the flag more than the default operator new, which calls malloc() out of line as well.
+// not inlined, or gcc takes the malloc() for a mismatch
+bool count_allocations = false;
+atomic<unsigned long> allocation_count(0);
+
+__attribute__((noinline)) void* operator new(size_t size){
+	if (count_allocations) allocation_count.fetch_add(1, memory_order_relaxed);
+	void* p = malloc(size? size : 1);
+	if (p == NULL) throw bad_alloc();
+	return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept{
+	free(p);
+}
+
 bool file_readable(string filepath){
 	int r = access(filepath.c_str(), F_OK); //check for existence
 	if (r != 0) return false;
@@ -44,27 +101,73 @@ bool file_readable(string filepath){
 	return (r == 0);
 }
 
+// formatting into a buffer given by the caller, without allocation or shared state, so they can be
+// used by any thread. they return the end of the written text, which is truncated at the end of buffer.
+char* fmt_str(char* p, char* end, const char* s){
+	while (*s && p < end) *p++ = *s++;
+	return p;
+}
+
+char* fmt_uint(char* p, char* end, unsigned long long v, unsigned int width = 1){ //padded with '0'
+	char digits[24]; unsigned int n = 0;
+	do {digits[n++] = '0' + v % 10; v /= 10;} while (v > 0);
+	while (n < width && n < sizeof(digits)) digits[n++] = '0';
+	while (n > 0 && p < end) *p++ = digits[--n];
+	return p;
+}
+
+// the same as the output of ostream in fixed notation, precision should be less than 10
+char* fmt_float(char* p, char* end, float f, unsigned int precision = 3, bool showpos = false){
+	static const double scale[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+	if (std::isnan(f)) return fmt_str(p, end, "nan");
+	if (signbit(f)) {if (p < end) *p++ = '-';}
+	else if (showpos) {if (p < end) *p++ = '+';}
+	if (std::isinf(f)) return fmt_str(p, end, "inf");
+	
+	double v = fabs((double)f) * scale[precision];
+	if (v >= 1e19) return fmt_str(p, end, "(overflow)"); //not expected here
+	unsigned long long u = (unsigned long long)nearbyint(v); //ties to even, as printf() does
+	p = fmt_uint(p, end, u / (unsigned long long)scale[precision]);
+	if (precision > 0){
+		if (p < end) *p++ = '.';
+		p = fmt_uint(p, end, u % (unsigned long long)scale[precision], precision);
+	}
+	return p;
+}
+
+// "%Y-%m-%d %H:%M:%S" of local time. localtime_r() is only called when the hour changes,
+// the cache is per thread. (changes of daylight saving time take place at the beginning of an hour)
+char* fmt_time(char* p, char* end, time_t t){
+	static thread_local time_t hourbegin = 1, hourend = 0;
+	static thread_local char prefix[16]; //"%Y-%m-%d %H:"
+	
+	if (t < hourbegin || t >= hourend){
+		tm st; localtime_r(&t, &st);
+		strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:", &st);
+		hourbegin = t - st.tm_min * 60 - st.tm_sec; hourend = hourbegin + 3600;
+	}
+	int s = t - hourbegin;
+	p = fmt_str(p, end, prefix);
+	p = fmt_uint(p, end, s / 60, 2);
+	if (p < end) *p++ = ':';
+	return fmt_uint(p, end, s % 60, 2);
+}
+
 string float_str(float f, unsigned int precision = 3, bool showpos = false){
-	static stringstream sstr; //not on stack
-	sstr.str(""); //clear buffer
-	sstr.setf(ios::fixed); sstr.precision(precision);
-	if (showpos)
-		sstr.setf(ios::showpos);
-	else
-		sstr.unsetf(ios::showpos);
-	sstr << f;
-	//stringsttream::str() returns a string object with a copy of contents in the stream buffer
-	return sstr.str();
+	char buf[48];
+	return string(buf, fmt_float(buf, buf + sizeof(buf), f, precision, showpos));
 }
 
 string time_str(time_t time, bool underline = false){
 	// here's C time operations, see C reference
 	// some of them can not be replaced by C++ <chrono> functions
-	string strformat = underline? "%Y-%m-%d_%H_%M_%S" : "%Y-%m-%d %H:%M:%S";
-	tm* pstructtime; char cstrtime[20];
+	char cstrtime[20];
+	if (! underline)
+		return string(cstrtime, fmt_time(cstrtime, cstrtime + sizeof(cstrtime), time));
 	
-	pstructtime = localtime(&time);
-	strftime(cstrtime, 20, strformat.c_str(), pstructtime);
+	tm structtime;
+	localtime_r(&time, &structtime); //localtime() isn't thread-safe
+	strftime(cstrtime, 20, "%Y-%m-%d_%H_%M_%S", &structtime);
 	string str = cstrtime; //implicit cast
 	return str;
 }
@@ -79,6 +182,29 @@ string difftime_str(time_t time){
 	return str;
 }
 
+// seconds since an unspecified point, not affected by changes of the system time
+double monotonic_now(){
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// nanoseconds of CLOCK_MONOTONIC, for measuring short intervals
+uint64_t monotonic_ns(){
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// total seconds the system has been suspended since boot: CLOCK_BOOTTIME counts the time of suspend,
+// while CLOCK_MONOTONIC doesn't. the difference of two values is the exact time suspended between them.
+double suspended_now(){
+	timespec bt, mt;
+	clock_gettime(CLOCK_BOOTTIME, &bt);
+	clock_gettime(CLOCK_MONOTONIC, &mt);
+	return (bt.tv_sec - mt.tv_sec) + (bt.tv_nsec - mt.tv_nsec) / 1e9;
+}
+
 bool askyn(){
 	static char s[1024];
 	s[0] = '\0';
@@ -88,26 +214,54 @@ bool askyn(){
 
 void cpause() {askyn();}
 
-struct power_reading { //sizeof per record (on 64-bit platforms): 32 B
+// optional attributes of power_supply besides status, voltage_now, current_now and capacity. each one is read
+// by power_status_reader only if the device provides it. they are kept apart from packed_reading in
+// reading_history, a column for each attribute the device has, so records of other devices don't grow.
+enum telemetry_t {tele_temp, tele_charge, tele_energy, tele_chargefull, tele_cycles, tele_power, tele_count};
+
+struct telemetry_desc {
+	const char* file; //in the device directory
+	const char* name; //in the query socket
+	const char* metric; //of the HTTP metrics
+	double scale; //from the integer in sysfs to the unit
+	const char* unit;
+};
+
+static const telemetry_desc telemetry_descs[tele_count] = {
+	{"temp", "temp", "battery_temperature_celsius", 0.1, "°C"},
+	{"charge_now", "charge", "battery_charge_mah", 1e-3, "mAh"},
+	{"energy_now", "energy", "battery_energy_wh", 1e-6, "Wh"},
+	{"charge_full", "charge_full", "battery_charge_full_mah", 1e-3, "mAh"},
+	{"cycle_count", "cycles", "battery_cycle_count", 1, ""},
+	{"power_now", "gauge_power", "battery_gauge_power_watts", 1e-6, "W"}
+};
+
+struct power_reading { //sizeof per record (on 64-bit platforms): 72 B
 	time_t time;
+	double mtime; //monotonic_now() of the sample, used for integration
+	double slept; //suspended_now() of the sample, 0 if unknown
 	bool charging; bool full;
 	float voltage; float E;
 	float current; //reference direction is the direction of charging
 	int capacity; //remaining, -1 if unknown
 	
 	bool outofrange; //a tag, reader cannot decide it
+	float telemetry[tele_count]; //in the units of telemetry_descs, NAN if it isn't provided
 	
 	power_reading();
-	power_reading(time_t t, bool c, bool f, float v, float a, float e, int cp = -1);
+	power_reading(time_t t, double mt, bool c, bool f, float v, float a, float e, int cp = -1);
 
 	float power();
 	string usrstr(bool withstatus = true);
+	char* format(char* p, char* end, bool withstatus = true) const; //the same as usrstr(), see fmt_str()
 	operator const string();
 };
 
-power_reading::power_reading(): outofrange(false) {};
-power_reading::power_reading(time_t t, bool c, bool f, float v, float a, float e, int cp):
-	time(t), charging(c), full(f), voltage(v), current(a), E(e), capacity(cp), outofrange(false) {}
+power_reading::power_reading(): time(0), slept(0), outofrange(false) {fill_n(telemetry, tele_count, NAN);};
+power_reading::power_reading(time_t t, double mt, bool c, bool f, float v, float a, float e, int cp):
+	time(t), mtime(mt), slept(0), charging(c), full(f), voltage(v), current(a), E(e), capacity(cp), outofrange(false) {
+	fill_n(telemetry, tele_count, NAN);
+}
 	
 // absorbed power of the battery.
 // but in cases of 'manualswitch' and 'charging', it is the power of computer circuit (minus).
@@ -119,36 +273,775 @@ float power_reading::power(){
 }
 	
 string power_reading::usrstr(bool withstatus){
-	return time_str(time) + " "
-		+ (withstatus? (charging? (full? "Full ":"Charging "):"Discharging ") : " ")
-		+ ((capacity >= 0)? to_string(capacity) + "%, " : "")
-		+ float_str(voltage) + " V"
-		+ ((E == voltage)? "" : (" (E: " + float_str(E) + " V)")) + ", "
-		+ float_str(current) + " A, "
-		+ float_str(voltage * current) + " W" + (outofrange? "   !":"") + "\n";
+	char buf[160];
+	return string(buf, format(buf, buf + sizeof(buf), withstatus));
+}
+
+char* power_reading::format(char* p, char* end, bool withstatus) const{
+	p = fmt_time(p, end, time);
+	p = fmt_str(p, end, " ");
+	p = fmt_str(p, end, withstatus? (charging? (full? "Full ":"Charging "):"Discharging ") : " ");
+	if (capacity >= 0) {p = fmt_uint(p, end, capacity); p = fmt_str(p, end, "%, ");}
+	p = fmt_float(p, end, voltage); p = fmt_str(p, end, " V");
+	if (E != voltage) {p = fmt_str(p, end, " (E: "); p = fmt_float(p, end, E); p = fmt_str(p, end, " V)");}
+	p = fmt_str(p, end, ", ");
+	p = fmt_float(p, end, current); p = fmt_str(p, end, " A, ");
+	p = fmt_float(p, end, voltage * current); p = fmt_str(p, end, " W");
+	if (outofrange) p = fmt_str(p, end, "   !");
+	return fmt_str(p, end, "\n");
 }
 	
 power_reading::operator const string(){ // implicit cast to const std::string
 	return this->usrstr(true);
 }
 
+// compact form of power_reading kept in reading_history, 16 B per record.
+// voltage and current are kept as integers, as they are provided by the kernel.
+struct packed_reading {
+	uint32_t dtime; //ms after the base time of the history
+	int32_t voltage; //µV
+	int32_t current; //µA
+	int16_t dE; //E - voltage, 100 µV
+	int8_t capacity;
+	uint8_t flags;
+	
+	static const uint8_t flag_charging = 1, flag_full = 2, flag_outofrange = 4;
+	
+	static packed_reading pack(const power_reading& r, double basemtime);
+	power_reading unpack(time_t basetime, double basemtime) const;
+};
+
+packed_reading packed_reading::pack(const power_reading& r, double basemtime){
+	packed_reading p;
+	p.dtime = (uint32_t)((r.mtime - basemtime) * 1000);
+	p.voltage = (int32_t)lround(r.voltage * 1e6);
+	p.current = (int32_t)lround(r.current * 1e6);
+	p.dE = (int16_t)max(-32768L, min(32767L, lround((r.E - r.voltage) * 1e4)));
+	p.capacity = (int8_t)r.capacity;
+	p.flags = (r.charging? flag_charging : 0) | (r.full? flag_full : 0) | (r.outofrange? flag_outofrange : 0);
+	return p;
+}
+
+power_reading packed_reading::unpack(time_t basetime, double basemtime) const{
+	float v = voltage / 1e6f;
+	power_reading r(basetime + (time_t)(dtime / 1000), basemtime + dtime / 1000.0,
+	                flags & flag_charging, flags & flag_full,
+	                v, current / 1e6f, (dE == 0)? v : v + dE / 1e4f, capacity);
+	r.outofrange = flags & flag_outofrange;
+	return r;
+}
+
+// a ring buffer of readings with memory allocated once. the oldest reading is dropped
+// when a reading is pushed into a full history.
+class reading_history {
+	unique_ptr<packed_reading[]> buf; //not initialized, pages are not touched before being used
+	unique_ptr<float[]> columns[tele_count]; //telemetry of the records, only those in the mask are allocated
+	size_t cap, head, count; //head is the index of the oldest reading
+	time_t basetime; double basemtime; //of the first reading pushed after clear()
+public:
+	reading_history(size_t capacity, uint8_t telemetry = 0); //bit k of the mask: column of telemetry_t k
+	
+	bool accepts(const power_reading& r) const; //false if its time is too far from the base time (about 49 days)
+	bool push(const power_reading& r); //returns accepts(r)
+	void pop_back();
+	void clear();
+	
+	size_t size() const;
+	size_t capacity() const;
+	bool full() const;
+	power_reading operator[](size_t i) const; //0 is the oldest one
+	power_reading front() const;
+	power_reading back() const;
+	
+	// the latest n records as at most 2 contiguous pieces of the ring (a before b), to be sent without copying.
+	// returns the count of records, which is less than n if there are not so many.
+	size_t latest(size_t n, const packed_reading*& a, size_t& na, const packed_reading*& b, size_t& nb) const;
+	time_t base_time() const;
+	double base_mtime() const;
+};
+
+reading_history::reading_history(size_t capacity, uint8_t telemetry):
+	buf(new packed_reading[capacity]), cap(capacity), head(0), count(0), basetime(0), basemtime(0) {
+	for (unsigned int k = 0; k < tele_count; k++)
+		if (telemetry & (1 << k)) columns[k].reset(new float[capacity]);
+}
+
+bool reading_history::accepts(const power_reading& r) const{
+	if (count == 0) return true;
+	double dt = (r.mtime - basemtime) * 1000;
+	return (dt >= 0 && dt <= numeric_limits<uint32_t>::max());
+}
+
+bool reading_history::push(const power_reading& r){
+	if (! accepts(r)) return false;
+	if (count == 0) {basetime = r.time; basemtime = r.mtime;}
+	
+	size_t i = (head + count) % cap;
+	buf[i] = packed_reading::pack(r, basemtime);
+	for (unsigned int k = 0; k < tele_count; k++)
+		if (columns[k]) columns[k][i] = r.telemetry[k];
+	
+	if (count < cap) count++;
+	else head = (head + 1) % cap; //overwritten
+	return true;
+}
+
+void reading_history::pop_back(){
+	if (count > 0) count--;
+}
+
+void reading_history::clear(){
+	head = count = 0;
+}
+
+size_t reading_history::size() const{
+	return count;
+}
+
+size_t reading_history::capacity() const{
+	return cap;
+}
+
+bool reading_history::full() const{
+	return count == cap;
+}
+
+power_reading reading_history::operator[](size_t i) const{
+	size_t j = (head + i) % cap;
+	power_reading r = buf[j].unpack(basetime, basemtime);
+	for (unsigned int k = 0; k < tele_count; k++)
+		if (columns[k]) r.telemetry[k] = columns[k][j];
+	return r;
+}
+
+power_reading reading_history::front() const{
+	return (*this)[0];
+}
+
+power_reading reading_history::back() const{
+	return (*this)[count - 1];
+}
+
+size_t reading_history::latest(size_t n, const packed_reading*& a, size_t& na, const packed_reading*& b, size_t& nb) const{
+	n = min(n, count);
+	size_t start = (head + count - n) % cap;
+	a = &buf[start]; na = min(n, cap - start);
+	b = &buf[0]; nb = n - na;
+	return n;
+}
+
+time_t reading_history::base_time() const{
+	return basetime;
+}
+
+double reading_history::base_mtime() const{
+	return basemtime;
+}
+
+// a period of readings in a history_tier, 32 B. peaks are kept as min/max, the rest as means.
+struct reading_aggregate {
+	uint32_t dtime; //ms of the beginning of the period after the base time of the tier
+	uint16_t count; //of readings
+	uint8_t flags; //of packed_reading: charging of the first reading, outofrange of any reading
+	int8_t capacity; //of the last reading
+	float vmin, vmax, vmean; //(V)
+	float imean; //(A)
+	float pmin, pmax; //(W) voltage * current, as in power_reading::format()
+};
+
+// aggregates of readings at a coarser resolution than reading_history, updated on each push. periods begin at
+// multiples of the period after the first reading, so that tiers of one session are aligned with each other.
+// it's a ring as well, the oldest aggregate is dropped when a period begins in a full tier.
+class history_tier {
+	unique_ptr<reading_aggregate[]> buf;
+	size_t cap, head, count;
+	double period; //(s)
+	time_t basetime; double basemtime; //of the first reading pushed after clear()
+public:
+	history_tier(double seconds, size_t capacity);
+	
+	void push(const power_reading& r); //r should be accepted by a reading_history of the same base time
+	void clear();
+	
+	size_t size() const;
+	double seconds() const;
+	const reading_aggregate& operator[](size_t i) const; //0 is the oldest one
+	double begin_mtime(size_t i) const;
+	char* format(char* p, char* end, size_t i) const; //a line of aggregate i, see fmt_str()
+};
+
+history_tier::history_tier(double seconds, size_t capacity):
+	buf(new reading_aggregate[capacity]), cap(capacity), head(0), count(0), period(seconds), basetime(0), basemtime(0) {}
+
+void history_tier::push(const power_reading& r){
+	if (count == 0) {basetime = r.time; basemtime = r.mtime;}
+	double offset = floor((r.mtime - basemtime) / period) * period;
+	uint32_t dtime = (uint32_t)(max(0.0, offset) * 1000);
+	float v = r.voltage, i = r.current, p = r.voltage * r.current;
+	
+	reading_aggregate* a = (count > 0)? &buf[(head + count - 1) % cap] : NULL;
+	if (a && a->dtime == dtime && a->count < numeric_limits<uint16_t>::max()){
+		a->count++;
+		a->vmin = min(a->vmin, v); a->vmax = max(a->vmax, v);
+		a->vmean += (v - a->vmean) / a->count; a->imean += (i - a->imean) / a->count;
+		a->pmin = min(a->pmin, p); a->pmax = max(a->pmax, p);
+		if (r.outofrange) a->flags |= packed_reading::flag_outofrange;
+		a->capacity = (int8_t)r.capacity;
+		return;
+	}
+	a = &buf[(head + count) % cap];
+	if (count < cap) count++;
+	else head = (head + 1) % cap; //overwritten
+	a->dtime = dtime; a->count = 1;
+	a->flags = (r.charging? packed_reading::flag_charging : 0) | (r.outofrange? packed_reading::flag_outofrange : 0);
+	a->capacity = (int8_t)r.capacity;
+	a->vmin = a->vmax = a->vmean = v; a->imean = i; a->pmin = a->pmax = p;
+}
+
+void history_tier::clear(){
+	head = count = 0;
+}
+
+size_t history_tier::size() const{
+	return count;
+}
+
+double history_tier::seconds() const{
+	return period;
+}
+
+const reading_aggregate& history_tier::operator[](size_t i) const{
+	return buf[(head + i) % cap];
+}
+
+double history_tier::begin_mtime(size_t i) const{
+	return basemtime + (*this)[i].dtime / 1000.0;
+}
+
+// "TIME ~ 10 s: N readings, 77%, 3.950 V (3.940 V ~ 3.960 V), -0.850 A, -3.358 W (-3.500 W ~ -3.300 W)"
+char* history_tier::format(char* p, char* end, size_t i) const{
+	const reading_aggregate& a = (*this)[i];
+	p = fmt_time(p, end, basetime + (time_t)(a.dtime / 1000));
+	p = fmt_str(p, end, " ~ "); p = fmt_uint(p, end, (unsigned long long)period); p = fmt_str(p, end, " s: ");
+	p = fmt_uint(p, end, a.count); p = fmt_str(p, end, " readings, ");
+	if (a.capacity >= 0) {p = fmt_uint(p, end, a.capacity); p = fmt_str(p, end, "%, ");}
+	p = fmt_float(p, end, a.vmean); p = fmt_str(p, end, " V (");
+	p = fmt_float(p, end, a.vmin); p = fmt_str(p, end, " V ~ ");
+	p = fmt_float(p, end, a.vmax); p = fmt_str(p, end, " V), ");
+	p = fmt_float(p, end, a.imean); p = fmt_str(p, end, " A, ");
+	p = fmt_float(p, end, a.vmean * a.imean); p = fmt_str(p, end, " W (");
+	p = fmt_float(p, end, a.pmin); p = fmt_str(p, end, " W ~ ");
+	p = fmt_float(p, end, a.pmax); p = fmt_str(p, end, " W)");
+	if (a.flags & packed_reading::flag_outofrange) p = fmt_str(p, end, "   !");
+	return fmt_str(p, end, "\n");
+}
+
+// statistics of a session, updated with each reading in constant time and memory.
+// the latest readings are held back in a small lookback window before they are counted,
+// so that they can still be dropped (see manualswitch in battery_monitor::makestat()).
+class session_stats {
+	vector<power_reading> held; vector<double> helddt; //ring of the window, with the duration after each reading
+	size_t window, head, nheld;
+	bool countr; //rWh is counted
+	
+	void commit(const power_reading& r, double dtime);
+public:
+	power_reading first, last; //counted ones
+	size_t count;
+	double Wh, mAh, rWh; //both Wh and mAh should be positive if it is charging, or minus if it is discharging
+	double duration; //(s) sum of integrated time
+	float maxW; int otimes; //times of out-of-range readings
+	float vmin, vmax; double vmean, vm2; //of voltage, vm2 is the sum of squared deviations (Welford)
+	float tmin, tmax; //of the temperature, NAN if it isn't provided
+	
+	session_stats(size_t lookback = 0);
+	void reset(bool countrwh);
+	
+	void add(const power_reading& r, double dtime); //power of the previous reading is integrated over dtime (s)
+	void end(double dtime); //the latest reading is integrated over dtime, until the end of the session
+	void flush(); //counts the held readings
+	
+	size_t size() const; //count of readings including held ones
+	size_t heldsize() const;
+	bool full() const; //the next add() counts heldat(0)
+	power_reading heldat(size_t i) const; //0 is the oldest held reading
+	void dropback(); //drops the latest held reading
+	
+	float vstddev() const;
+};
+
+session_stats::session_stats(size_t lookback):
+	held(lookback + 1), helddt(lookback + 1), window(lookback + 1) {reset(true);}
+
+void session_stats::reset(bool countrwh){
+	head = nheld = 0; countr = countrwh;
+	count = 0; Wh = mAh = rWh = 0; duration = 0; maxW = 0; otimes = 0;
+	vmin = vmax = 0; vmean = vm2 = 0;
+	tmin = tmax = NAN;
+}
+
+void session_stats::commit(const power_reading& r, double dtime){
+	power_reading p = r; //power() isn't const
+	Wh += p.power() * dtime/3600;
+	mAh += p.current * 1000 * dtime/3600;
+	// energy wasted on internal resistance, always positive
+	if (countr) rWh += abs((p.E - p.voltage) * p.current) * dtime/3600;
+	duration += dtime;
+	
+	if (abs(p.power()) > abs(maxW)) maxW = p.power();
+	if (p.outofrange) otimes++;
+	
+	if (count == 0) {first = p; vmin = vmax = p.voltage;}
+	last = p; count++;
+	vmin = min(vmin, p.voltage); vmax = max(vmax, p.voltage);
+	float t = p.telemetry[tele_temp];
+	if (! std::isnan(t)) {tmin = std::isnan(tmin)? t : min(tmin, t); tmax = std::isnan(tmax)? t : max(tmax, t);}
+	double delta = p.voltage - vmean;
+	vmean += delta / count;
+	vm2 += delta * (p.voltage - vmean);
+}
+
+void session_stats::add(const power_reading& r, double dtime){
+	if (nheld > 0) helddt[(head + nheld - 1) % window] = dtime;
+	if (nheld == window){ //window is full, the oldest is counted
+		commit(held[head], helddt[head]);
+		head = (head + 1) % window; nheld--;
+	}
+	held[(head + nheld) % window] = r; helddt[(head + nheld) % window] = 0;
+	nheld++;
+}
+
+void session_stats::end(double dtime){
+	if (nheld > 0) helddt[(head + nheld - 1) % window] = dtime;
+}
+
+void session_stats::flush(){
+	for (; nheld > 0; nheld--){
+		commit(held[head], helddt[head]);
+		head = (head + 1) % window;
+	}
+}
+
+size_t session_stats::size() const{
+	return count + nheld;
+}
+
+size_t session_stats::heldsize() const{
+	return nheld;
+}
+
+bool session_stats::full() const{
+	return nheld == window;
+}
+
+power_reading session_stats::heldat(size_t i) const{
+	return held[(head + i) % window];
+}
+
+void session_stats::dropback(){
+	if (nheld > 0) nheld--;
+}
+
+float session_stats::vstddev() const{
+	return (count > 1)? sqrt(vm2 / (count - 1)) : 0;
+}
+
+// the backend of power_status_reader: the directory of devices (-p parameter, e.g. a fake tree on tmpfs),
+// and the function reading their attributes, which is replaced in benchmark mode (-b)
+string power_supply_root = "/sys/class/power_supply/";
+typedef ssize_t (*pread_function)(int fd, void* buf, size_t count, off_t offset);
+pread_function sysfs_pread = ::pread;
+
+// batched reads of sysfs attributes through io_uring (raw syscalls, without liburing). the reads of all batteries
+// of a tick are queued, then submitted by one io_uring_enter(), which waits for all of their completions too.
+// the fds are registered once. sysfs doesn't support non-blocking reads, so the kernel completes them in its
+// workers; it pays off with many attributes, see -b. built without SBVA_IO_URING, it's never available.
+struct io_uring_sqe; struct io_uring_cqe;
+class sysfs_ring {
+	int rfd; unsigned int entries, queued, sqlocal; //sqlocal: tail of the submission queue, not yet published
+	char* sqmap; size_t sqmapsize; char* cqmap; size_t cqmapsize; io_uring_sqe* sqes; size_t sqessize;
+	unsigned int *sqtail, *sqmask, *sqarray, *cqhead, *cqtail, *cqmask; io_uring_cqe* cqes;
+	vector<int> files;
+	
+	void close();
+public:
+	unsigned long enters = 0; //calls of io_uring_enter(), for benchmark mode
+	
+	sysfs_ring(unsigned int n); //of reads in a tick
+	sysfs_ring(const sysfs_ring&) = delete;
+	~sysfs_ring();
+	operator const bool() const;
+	
+	int addfile(int fd); //returns the index of the fd, which is registered by registerfiles()
+	bool registerfiles();
+	bool queue(unsigned int index, char* buf, unsigned int size, int* result); //*result is set by submit(), -1 if failed
+	bool submit(); //submits the queued reads and waits for all of them
+};
+
+sysfs_ring::sysfs_ring(unsigned int n): rfd(-1), entries(0), queued(0), sqlocal(0),
+	sqmap((char*)MAP_FAILED), sqmapsize(0), cqmap((char*)MAP_FAILED), cqmapsize(0), sqes((io_uring_sqe*)MAP_FAILED), sqessize(0) {
+#ifdef SBVA_IO_URING
+	io_uring_params p; memset(&p, 0, sizeof(p));
+	rfd = syscall(__NR_io_uring_setup, max(n, 1U), &p);
+	if (rfd < 0) return;
+	entries = p.sq_entries;
+	sqmapsize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cqmapsize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0; //both rings in one mapping (since 5.4)
+	if (single) sqmapsize = cqmapsize = max(sqmapsize, cqmapsize);
+	
+	sqmap = (char*)mmap(NULL, sqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+	cqmap = single? sqmap : (char*)mmap(NULL, cqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+	sqessize = p.sq_entries * sizeof(io_uring_sqe);
+	sqes = (io_uring_sqe*)mmap(NULL, sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+	if (sqmap == MAP_FAILED || cqmap == MAP_FAILED || sqes == MAP_FAILED) {close(); return;}
+	
+	sqtail = (unsigned int*)(sqmap + p.sq_off.tail); sqmask = (unsigned int*)(sqmap + p.sq_off.ring_mask);
+	sqarray = (unsigned int*)(sqmap + p.sq_off.array);
+	cqhead = (unsigned int*)(cqmap + p.cq_off.head); cqtail = (unsigned int*)(cqmap + p.cq_off.tail);
+	cqmask = (unsigned int*)(cqmap + p.cq_off.ring_mask); cqes = (io_uring_cqe*)(cqmap + p.cq_off.cqes);
+	sqlocal = *sqtail;
+#else
+	(void)n; //rfd stays -1
+#endif
+}
+
+sysfs_ring::~sysfs_ring(){
+	close();
+}
+
+void sysfs_ring::close(){
+	if (sqes != MAP_FAILED) munmap(sqes, sqessize);
+	if (cqmap != MAP_FAILED && cqmap != sqmap) munmap(cqmap, cqmapsize);
+	if (sqmap != MAP_FAILED) munmap(sqmap, sqmapsize);
+	if (rfd >= 0) ::close(rfd);
+	rfd = -1; sqmap = cqmap = (char*)MAP_FAILED; sqes = (io_uring_sqe*)MAP_FAILED;
+}
+
+sysfs_ring::operator const bool() const{
+	return rfd >= 0;
+}
+
+int sysfs_ring::addfile(int fd){
+	files.push_back(fd);
+	return files.size() - 1;
+}
+
+#ifdef SBVA_IO_URING
+bool sysfs_ring::registerfiles(){
+	return rfd >= 0 && ! files.empty()
+	    && syscall(__NR_io_uring_register, rfd, IORING_REGISTER_FILES, files.data(), files.size()) == 0;
+}
+
+bool sysfs_ring::queue(unsigned int index, char* buf, unsigned int size, int* result){
+	*result = -1;
+	if (rfd < 0 || queued >= entries) return false;
+	unsigned int i = sqlocal & *sqmask;
+	io_uring_sqe& sqe = sqes[i];
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_READ; sqe.flags = IOSQE_FIXED_FILE; sqe.fd = index; //index of the registered fd
+	sqe.addr = (uintptr_t)buf; sqe.len = size; sqe.off = 0;
+	sqe.user_data = (uintptr_t)result;
+	sqarray[i] = i;
+	sqlocal++; queued++;
+	return true;
+}
+
+bool sysfs_ring::submit(){
+	if (rfd < 0) return false;
+	__atomic_store_n(sqtail, sqlocal, __ATOMIC_RELEASE);
+	unsigned int tosubmit = queued, pending = queued; queued = 0;
+	while (pending > 0){
+		int n = syscall(__NR_io_uring_enter, rfd, tosubmit, pending, IORING_ENTER_GETEVENTS, NULL, 0);
+		enters++;
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {close(); return false;} //the results not set are left as failed
+		tosubmit -= min((unsigned int)n, tosubmit);
+		unsigned int head = *cqhead, tail = __atomic_load_n(cqtail, __ATOMIC_ACQUIRE);
+		for (; head != tail && pending > 0; head++, pending--){
+			const io_uring_cqe& cqe = cqes[head & *cqmask];
+			*(int*)(uintptr_t)cqe.user_data = cqe.res;
+		}
+		__atomic_store_n(cqhead, head, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+#else
+bool sysfs_ring::registerfiles(){
+	return false;
+}
+
+bool sysfs_ring::queue(unsigned int, char*, unsigned int, int* result){
+	*result = -1;
+	return false;
+}
+
+bool sysfs_ring::submit(){
+	return false;
+}
+#endif
+
+// returns paths (with '/' at the end) of all devices in power_supply_root providing voltage_now
+vector<string> find_power_supplies(){
+	vector<string> devicepaths;
+	string fpath = power_supply_root;
+	string gname, spath;
+	
+	DIR* dr = opendir(fpath.c_str());
+	if (! dr) return devicepaths;
+	struct dirent* p;
+	while ((p = readdir(dr))){ //get the pointer of dirent info of the next item, break if NULL
+		gname = p->d_name; //transfer to C++ string
+		if (gname == "." || gname == "..") continue; //skip
+		spath = fpath + gname + "/voltage_now";
+		if (access(spath.c_str(), F_OK) == 0) //file exists
+			devicepaths.push_back(fpath + gname + '/');
+	}
+	closedir(dr);
+	
+	sort(devicepaths.begin(), devicepaths.end()); //readdir() gives no specific order
+	return devicepaths;
+}
+
+// buffered capture of an IIO device (/dev/iio:deviceN), which some fuel gauges and PMICs provide for fast ADC
+// channels, while their power_supply attributes are refreshed slowly. the voltage and current channels
+// (and the timestamp, if there is one) are enabled in scan_elements, other channels are disabled, and the
+// buffer is read in bulk without blocking. samples are converted by (raw + offset) * scale of the channels,
+// which are in mV and mA by the IIO ABI. the current should be positive when charging, like current_now.
+string iio_root = "/sys/bus/iio/devices/", iio_dev_root = "/dev/";
+
+class iio_buffer {
+	struct channel {
+		string name; unsigned int index;
+		bool bigendian, issigned; unsigned int bits, storagebytes, shift;
+		size_t offset; //in a scan
+	};
+	string devicedir; int fd;
+	vector<channel> channels; //enabled ones, in the order of scans
+	int vchannel, ichannel, tchannel; //indexes in channels, tchannel < 0 if there is no timestamp
+	double vscale, voffset, iscale, ioffset;
+	size_t scansize;
+	vector<char> buf; size_t buflen; //incomplete scan at the beginning of buf
+	
+	static bool writeattr(const string& path, const string& value);
+	static string readattr(const string& path);
+	bool setupchannel(const string& name, bool enable);
+	int64_t value(const char* scan, const channel& c) const;
+public:
+	iio_buffer();
+	iio_buffer(const iio_buffer&) = delete; //owns the file descriptor
+	~iio_buffer();
+	operator const bool() const;
+	
+	// device is the name in iio_root (iio:device0), vname and iname are channels (in_voltage0, in_current0).
+	bool open(const string& device, const string& vname, const string& iname, const string& trigger, bool timestamp);
+	bool timestamped() const; //timestamps are of CLOCK_MONOTONIC
+	// reads the scans available into u (V), i (A) and t (s, if timestamped), returns the count
+	size_t read(vector<float>& u, vector<float>& i, vector<double>& t);
+	void close();
+};
+
+iio_buffer::iio_buffer(): fd(-1), vchannel(-1), ichannel(-1), tchannel(-1), scansize(0), buflen(0) {}
+
+iio_buffer::~iio_buffer(){
+	close();
+}
+
+iio_buffer::operator const bool() const{
+	return fd >= 0;
+}
+
+bool iio_buffer::writeattr(const string& path, const string& value){
+	int wfd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+	if (wfd < 0) return false;
+	bool ok = (write(wfd, value.data(), value.length()) == (ssize_t)value.length());
+	::close(wfd);
+	return ok;
+}
+
+string iio_buffer::readattr(const string& path){
+	char tmp[64];
+	int rfd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (rfd < 0) return "";
+	ssize_t n = ::read(rfd, tmp, sizeof(tmp) - 1);
+	::close(rfd);
+	if (n <= 0) return "";
+	while (n > 0 && (tmp[n - 1] == '\n' || tmp[n - 1] == ' ')) n--;
+	return string(tmp, n);
+}
+
+// reads _index and _type of a channel in scan_elements, and enables or disables it
+bool iio_buffer::setupchannel(const string& name, bool enable){
+	string prefix = devicedir + "scan_elements/" + name;
+	if (! writeattr(prefix + "_en", enable? "1" : "0") && readattr(prefix + "_en") != (enable? "1" : "0")) return false;
+	if (! enable) return true;
+	
+	channel c; c.name = name;
+	char endian[3] = {0}, sign = 's'; unsigned int storagebits;
+	string type = readattr(prefix + "_type"), index = readattr(prefix + "_index");
+	// "le:s12/16>>4", repeated elements ("X2") aren't supported
+	if (sscanf(type.c_str(), "%2[bl]e:%c%u/%u>>%u", endian, &sign, &c.bits, &storagebits, &c.shift) != 5
+	    || type.find('X') != string::npos || index == "")
+		return false;
+	c.bigendian = (endian[0] == 'b'); c.issigned = (sign == 's');
+	c.storagebytes = storagebits / 8; c.index = atoi(index.c_str());
+	if (c.storagebytes != 1 && c.storagebytes != 2 && c.storagebytes != 4 && c.storagebytes != 8) return false;
+	if (c.bits == 0 || c.bits > 64) return false;
+	channels.push_back(c);
+	return true;
+}
+
+bool iio_buffer::open(const string& device, const string& vname, const string& iname, const string& trigger, bool timestamp){
+	close();
+	devicedir = iio_root + device + '/';
+	channels.clear(); vchannel = ichannel = tchannel = -1;
+	writeattr(devicedir + "buffer/enable", "0"); //scan_elements can't be changed while it's enabled
+	
+	// only the wanted channels are enabled, so the layout of scans is known
+	DIR* dr = opendir((devicedir + "scan_elements").c_str());
+	if (! dr) return false;
+	vector<string> others; struct dirent* p;
+	while ((p = readdir(dr))){
+		string fname = p->d_name;
+		if (fname.length() > 3 && fname.compare(fname.length() - 3, 3, "_en") == 0)
+			others.push_back(fname.substr(0, fname.length() - 3));
+	}
+	closedir(dr);
+	bool hastimestamp = timestamp && find(others.begin(), others.end(), "in_timestamp") != others.end();
+	for (unsigned int i = 0; i < others.size(); i++)
+		if (others[i] != vname && others[i] != iname && ! (hastimestamp && others[i] == "in_timestamp"))
+			setupchannel(others[i], false);
+	if (! setupchannel(vname, true) || ! setupchannel(iname, true)) return false;
+	if (hastimestamp && ! setupchannel("in_timestamp", true)) hastimestamp = false;
+	
+	// elements are ordered by index and aligned to their size, as is the whole scan
+	sort(channels.begin(), channels.end(), [](const channel& a, const channel& b) {return a.index < b.index;});
+	size_t maxbytes = 1; scansize = 0;
+	for (unsigned int i = 0; i < channels.size(); i++){
+		channel& c = channels[i];
+		scansize = (scansize + c.storagebytes - 1) / c.storagebytes * c.storagebytes;
+		c.offset = scansize; scansize += c.storagebytes;
+		maxbytes = max<size_t>(maxbytes, c.storagebytes);
+		if (c.name == vname) vchannel = i;
+		else if (c.name == iname) ichannel = i;
+		else tchannel = i;
+	}
+	scansize = (scansize + maxbytes - 1) / maxbytes * maxbytes;
+	if (hastimestamp && ! writeattr(devicedir + "current_timestamp_clock", "monotonic")
+	    && readattr(devicedir + "current_timestamp_clock") != "monotonic")
+		tchannel = -1; //timestamps of another clock aren't used
+	
+	// a scale is of the channel or shared by the type ("in_voltage_scale"), the offset is optional
+	string vtype = vname.substr(0, vname.find_last_not_of("0123456789") + 1);
+	string itype = iname.substr(0, iname.find_last_not_of("0123456789") + 1);
+	string s;
+	vscale = ((s = readattr(devicedir + vname + "_scale")) != "" || (s = readattr(devicedir + vtype + "_scale")) != "")? atof(s.c_str()) : 1;
+	iscale = ((s = readattr(devicedir + iname + "_scale")) != "" || (s = readattr(devicedir + itype + "_scale")) != "")? atof(s.c_str()) : 1;
+	voffset = atof(readattr(devicedir + vname + "_offset").c_str());
+	ioffset = atof(readattr(devicedir + iname + "_offset").c_str());
+	
+	if (trigger != "" && ! writeattr(devicedir + "trigger/current_trigger", trigger)) return false;
+	writeattr(devicedir + "buffer/length", "4096");
+	if (! writeattr(devicedir + "buffer/enable", "1") && readattr(devicedir + "buffer/enable") != "1") return false;
+	
+	fd = ::open((iio_dev_root + device).c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {writeattr(devicedir + "buffer/enable", "0"); return false;}
+	buf.resize(max<size_t>(0x10000, scansize * 2)); buflen = 0;
+	return true;
+}
+
+bool iio_buffer::timestamped() const{
+	return tchannel >= 0;
+}
+
+int64_t iio_buffer::value(const char* scan, const channel& c) const{
+	const unsigned char* b = (const unsigned char*)scan + c.offset;
+	uint64_t v = 0;
+	for (unsigned int k = 0; k < c.storagebytes; k++)
+		v |= (uint64_t)b[c.bigendian? k : c.storagebytes - 1 - k] << (8 * (c.storagebytes - 1 - k));
+	v >>= c.shift;
+	if (c.bits < 64){
+		v &= (1ull << c.bits) - 1;
+		if (c.issigned && (v >> (c.bits - 1))) v |= ~0ull << c.bits; //sign extension
+	}
+	return (int64_t)v;
+}
+
+size_t iio_buffer::read(vector<float>& u, vector<float>& i, vector<double>& t){
+	u.clear(); i.clear(); t.clear();
+	if (fd < 0) return 0;
+	while (true){
+		ssize_t n = ::read(fd, buf.data() + buflen, buf.size() - buflen);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		buflen += n;
+		
+		size_t pos = 0;
+		for (; pos + scansize <= buflen; pos += scansize){
+			const char* scan = buf.data() + pos;
+			u.push_back((value(scan, channels[vchannel]) + voffset) * vscale / 1000);
+			i.push_back((value(scan, channels[ichannel]) + ioffset) * iscale / 1000);
+			if (tchannel >= 0) t.push_back(value(scan, channels[tchannel]) / 1e9);
+		}
+		memmove(buf.data(), buf.data() + pos, buflen - pos); buflen -= pos;
+	}
+	return u.size();
+}
+
+void iio_buffer::close(){
+	if (fd < 0) return;
+	::close(fd); fd = -1;
+	writeattr(devicedir + "buffer/enable", "0");
+}
+
 class power_status_reader {
-	string devicepath; bool manualswitch; float ir;
+	string devicepath, name; bool manualswitch; float ir;
 	string statuspath, voltagepath, currentpath, capacitypath;
+	int statusfd, voltagefd, currentfd, capacityfd; //opened once, re-read by pread() in read()
+	int telefds[tele_count]; //of telemetry_descs, -1 if the device doesn't provide it
 	float maxv; string tech;
 	bool invalid;
 	
+	unique_ptr<iio_buffer> iio; //optional fast path of voltage and current, see readbuffer()
+	vector<float> iiou, iioi; vector<double> iiot;
+	double pmtime; //of the latest reading made of the buffer
+	
+	sysfs_ring* ring; //optional batched reads of the attributes, see prefetch()
+	struct prefetched_attr {int fd; unsigned int index; int result; bool valid; char buf[32];};
+	prefetched_attr prefetched[4 + tele_count]; unsigned int nprefetched;
+	
 	float freadvalue(string filepath);
 	string freadstring(string filepath);
+	ssize_t readattr(int fd, char* buf, size_t size); //the prefetched content, or pread()
+	void dropprefetched();
+	void readtelemetry(power_reading& r);
+	long preadvalue(int fd);
+	double preadnumber(int fd); //NAN if it can't be read, for readtelemetry()
+	char preadchar(int fd);
 public:
 	bool charging; //allows manual setting in special conditions
 	
-	power_status_reader(bool m, float r);
+	power_status_reader(string path, bool m, float r); //path is given by find_power_supplies()
+	power_status_reader(const power_status_reader&) = delete; //owns file descriptors
+	~power_status_reader();
 	operator const bool() const;
 	
 	power_reading read();
+	// voltage and current are read from an IIO buffer instead, see iio_buffer::open()
+	bool usebuffer(const string& device, const string& vname, const string& iname, const string& trigger);
+	bool buffered() const;
+	// readings of the scans captured since the last call, with the status and the capacity read once.
+	// scans not later than the previous reading are dropped, so the readings are in order.
+	size_t readbuffer(vector<power_reading>& out);
 	float maxvoltage();
 	string technology();
+	string devicename(); //BAT0, BAT1, etc.
+	float resistance() const;
+	void setresistance(float r); //used for E of later readings
+	
+	uint8_t telemetry() const; //bit k is set if telemetry_t k is provided
+	bool attach(sysfs_ring* r); //adds the fds to r, before r->registerfiles(). NULL detaches it
+	void prefetch(); //queues the reads of the next read() or readbuffer() into the ring, before it's submitted
 };
 
 float power_status_reader::freadvalue(string filepath){
@@ -169,30 +1062,61 @@ string power_status_reader::freadstring(string filepath){
 	return str;
 }
 
-power_status_reader::power_status_reader(bool m, float r):
-	manualswitch(m), ir(r) {
-	
-	//find device path in /sys/class/power_supply
-	devicepath = "";
-	string fpath = "/sys/class/power_supply/";
-	string gname, spath;
-	if (access(fpath.c_str(), F_OK) == 0){ //this path exists
-		DIR* dr;
-		struct dirent* p;
-		dr = opendir(fpath.c_str());
-		while (p = readdir(dr)){ //get the pointer of dirent info of the next item, break if NULL
-			gname = p->d_name; //transfer to C++ string
-			if (gname == "." || gname == ".."); //skip
-			else {
-				spath = fpath + gname + "/voltage_now";
-				if (access(spath.c_str(), F_OK) == 0){ //file exists
-					devicepath = fpath + gname + '/'; //device path is known
-					break;
-				}
-			}
-		}
+// sysfs regenerates the content on every read at offset 0, so the file needn't be reopened.
+// it saves the open(), close() and access() calls and the ifstream allocations of each sample.
+ssize_t power_status_reader::readattr(int fd, char* buf, size_t size){
+	for (unsigned int k = 0; k < nprefetched; k++){
+		prefetched_attr& a = prefetched[k];
+		if (a.fd != fd || ! a.valid) continue;
+		a.valid = false;
+		if (a.result < 0) break; //failed, it's read again
+		size_t n = min((size_t)a.result, size);
+		memcpy(buf, a.buf, n);
+		return n;
 	}
+	return sysfs_pread(fd, buf, size, 0);
+}
+
+void power_status_reader::dropprefetched(){ //those not taken are not of the next reading
+	for (unsigned int k = 0; k < nprefetched; k++) prefetched[k].valid = false;
+}
+
+long power_status_reader::preadvalue(int fd){
+	if (fd < 0) return 0;
+	
+	char buf[32]; //on stack, the value is a decimal integer
+	ssize_t n = readattr(fd, buf, sizeof(buf) - 1);
+	if (n <= 0) return 0;
+	buf[n] = '\0';
+	return strtol(buf, NULL, 10);
+}
+
+// a failed read isn't a value: temp and the counters of some gauges give ENODATA, EINVAL or EIO at times
+double power_status_reader::preadnumber(int fd){
+	char buf[32]; char* end;
+	ssize_t n = readattr(fd, buf, sizeof(buf) - 1);
+	if (n <= 0) return NAN;
+	buf[n] = '\0';
+	long v = strtol(buf, &end, 10);
+	return (end == buf)? NAN : v;
+}
+
+char power_status_reader::preadchar(int fd){
+	if (fd < 0) return '\0';
+	
+	char buf[16];
+	ssize_t n = readattr(fd, buf, sizeof(buf));
+	return (n > 0)? buf[0] : '\0';
+}
+
+power_status_reader::power_status_reader(string path, bool m, float r):
+	devicepath(path), manualswitch(m), ir(r), statusfd(-1), voltagefd(-1), currentfd(-1), capacityfd(-1), pmtime(0),
+	ring(NULL), nprefetched(0) {
+	
+	fill_n(telefds, tele_count, -1);
 	if (devicepath == "") {invalid = true; return;}
+	name = devicepath.substr(0, devicepath.length() - 1);
+	name = name.substr(name.rfind('/') + 1);
 	
 	statuspath = voltagepath = currentpath = capacitypath = devicepath;
 	statuspath += "status";
@@ -200,17 +1124,20 @@ power_status_reader::power_status_reader(bool m, float r):
 	currentpath += "current_now";
 	capacitypath += "capacity";
 	
-	if (!   (file_readable(statuspath)
-		  && file_readable(voltagepath)
-		  && file_readable(currentpath)))
-		invalid = true;
-	else {
+	statusfd = open(statuspath.c_str(), O_RDONLY | O_CLOEXEC);
+	voltagefd = open(voltagepath.c_str(), O_RDONLY | O_CLOEXEC);
+	currentfd = open(currentpath.c_str(), O_RDONLY | O_CLOEXEC);
+	capacityfd = open(capacitypath.c_str(), O_RDONLY | O_CLOEXEC); //optional
+	for (unsigned int k = 0; k < tele_count; k++)
+		telefds[k] = open((devicepath + telemetry_descs[k].file).c_str(), O_RDONLY | O_CLOEXEC);
+	
+	invalid = (statusfd < 0 || voltagefd < 0 || currentfd < 0);
+	if (! invalid){
 		if (! manualswitch)
 			this->read(); //correct value of 'charging'
 		else
 			charging = false;
 	}
-	invalid = false;
 	
 	string techpath = devicepath + "technology";
 	if (! file_readable(techpath))
@@ -229,6 +1156,14 @@ power_status_reader::power_status_reader(bool m, float r):
 	}
 }
 	
+power_status_reader::~power_status_reader(){
+	int fds[] = {statusfd, voltagefd, currentfd, capacityfd};
+	for (int fd : fds)
+		if (fd >= 0) close(fd);
+	for (int fd : telefds)
+		if (fd >= 0) close(fd);
+}
+
 power_status_reader::operator const bool() const{
 	return (! invalid);
 }
@@ -238,41 +1173,304 @@ power_reading power_status_reader::read(){
 	
 	bool full = false;
 	if (! manualswitch){
-		char f = freadstring(statuspath).c_str()[0];
+		char f = preadchar(statusfd);
 		if (tolower(f) == 'f') //first char of 'Full'
 			charging = full = true;
 		else
 			charging = (tolower(f) == 'c'); //first char of 'Charging'
 	}
 	
-	float u = freadvalue(voltagepath)/1000/1000;
-	float i = freadvalue(currentpath)/1000/1000; //reference direction is the direction of charging
+	float u = preadvalue(voltagefd)/1000.0/1000;
+	float i = preadvalue(currentfd)/1000.0/1000; //reference direction is the direction of charging
 	
 	float e; //actually E can't be calculated because charging current is unknown
 	if (manualswitch && charging) e = u;
 	else e = u + (-i * ir); // reference direction -i is that of discharging
 	
 	int cp = -1;
-	if (! manualswitch) cp = freadvalue(capacitypath);
+	if (! manualswitch && capacityfd >= 0) cp = preadvalue(capacityfd);
 	
-	return power_reading(time(NULL), charging, full, u, i, e, cp);
+	power_reading r(time(NULL), monotonic_now(), charging, full, u, i, e, cp);
+	readtelemetry(r);
+	dropprefetched();
+	r.slept = suspended_now();
+	if (iio) pmtime = r.mtime;
+	return r;
 }
-	
-float power_status_reader::maxvoltage(){
-	return maxv;
+
+void power_status_reader::readtelemetry(power_reading& r){
+	for (unsigned int k = 0; k < tele_count; k++)
+		if (telefds[k] >= 0) r.telemetry[k] = preadnumber(telefds[k]) * telemetry_descs[k].scale;
 }
-	
-string power_status_reader::technology(){
-	return tech;
+
+uint8_t power_status_reader::telemetry() const{
+	uint8_t mask = 0;
+	for (unsigned int k = 0; k < tele_count; k++)
+		if (telefds[k] >= 0) mask |= 1 << k;
+	return mask;
+}
+
+bool power_status_reader::attach(sysfs_ring* r){
+	ring = NULL; nprefetched = 0;
+	if (r == NULL || invalid) return r == NULL;
+	vector<int> fds = {manualswitch? -1 : statusfd, voltagefd, currentfd, manualswitch? -1 : capacityfd};
+	fds.insert(fds.end(), telefds, telefds + tele_count);
+	for (int fd : fds){
+		if (fd < 0) continue;
+		prefetched_attr& a = prefetched[nprefetched++];
+		a.fd = fd; a.index = r->addfile(fd); a.result = -1; a.valid = false;
+	}
+	ring = r;
+	return true;
+}
+
+void power_status_reader::prefetch(){
+	if (ring == NULL) return;
+	for (unsigned int k = 0; k < nprefetched; k++){
+		prefetched_attr& a = prefetched[k];
+		a.valid = ring->queue(a.index, a.buf, sizeof(a.buf), &a.result);
+	}
+}
+	
+bool power_status_reader::usebuffer(const string& device, const string& vname, const string& iname, const string& trigger){
+	if (invalid) return false;
+	iio.reset(new iio_buffer());
+	if (! iio->open(device, vname, iname, trigger, true)) {iio.reset(); return false;}
+	pmtime = monotonic_now();
+	return true;
+}
+
+bool power_status_reader::buffered() const{
+	return (bool)iio;
+}
+
+size_t power_status_reader::readbuffer(vector<power_reading>& out){
+	out.clear();
+	if (! iio || iio->read(iiou, iioi, iiot) == 0) {dropprefetched(); return 0;}
+	
+	bool full = false;
+	if (! manualswitch){
+		char f = preadchar(statusfd);
+		if (tolower(f) == 'f') charging = full = true;
+		else charging = (tolower(f) == 'c');
+	}
+	int cp = -1;
+	if (! manualswitch && capacityfd >= 0) cp = preadvalue(capacityfd);
+	power_reading base; readtelemetry(base); //read once as well
+	dropprefetched();
+	
+	// without timestamps, the scans are spread evenly since the previous call
+	double now = monotonic_now(), slept = suspended_now(); time_t t = time(NULL);
+	size_t n = iiou.size();
+	for (size_t k = 0; k < n; k++){
+		double mt = iio->timestamped()? iiot[k] : pmtime + (now - pmtime) * (k + 1) / n;
+		if (mt <= pmtime || mt > now) continue;
+		float u = iiou[k], i = iioi[k];
+		float e = (manualswitch && charging)? u : u + (-i * ir);
+		power_reading r(t - (time_t)(now - mt), mt, charging, full, u, i, e, cp);
+		r.slept = slept;
+		copy(base.telemetry, base.telemetry + tele_count, r.telemetry);
+		out.push_back(r);
+		pmtime = mt;
+	}
+	return out.size();
+}
+
+float power_status_reader::maxvoltage(){
+	return maxv;
+}
+	
+string power_status_reader::technology(){
+	return tech;
+}
+
+string power_status_reader::devicename(){
+	return name;
+}
+
+float power_status_reader::resistance() const{
+	return ir;
+}
+
+void power_status_reader::setresistance(float r){
+	ir = r;
+}
+
+// a periodic timer of CLOCK_BOOTTIME. unlike sleep() after each loop, the time spent
+// on reading and printing doesn't delay the next tick, so the sampling period won't drift.
+// the ticks passed during suspend are expired on resume, so a sample is taken immediately then.
+// other file descriptors can be watched, so that wait() returns as soon as any of them is readable.
+class sample_scheduler {
+	int tfd;
+	vector<pollfd> pfds; //the timer is the first one
+public:
+	sample_scheduler(double period);
+	sample_scheduler(const sample_scheduler&) = delete;
+	~sample_scheduler();
+	operator const bool() const;
+	
+	int fd() const; //of the timer, so that it can be watched by another scheduler
+	void watch(int fd);
+	void reschedule(double delay, double period); //the next tick is after delay (s), then every period
+	void align(double period); //ticks at multiples of period since boot, so other periodic timers may share them
+	unsigned long wait(); //returns count of periods elapsed since last tick, more than 1 if some ticks are missed,
+	                      //or 0 if it is woken up by a watched fd
+	bool readable(int fd) const; //checks the result of last wait()
+};
+
+sample_scheduler::sample_scheduler(double period){
+	tfd = timerfd_create(CLOCK_BOOTTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (tfd < 0) return;
+	
+	itimerspec its;
+	its.it_interval.tv_sec = (time_t)period;
+	its.it_interval.tv_nsec = (long)((period - its.it_interval.tv_sec) * 1e9);
+	clock_gettime(CLOCK_BOOTTIME, &its.it_value); //absolute time of the first tick
+	its.it_value.tv_sec += its.it_interval.tv_sec;
+	its.it_value.tv_nsec += its.it_interval.tv_nsec;
+	if (its.it_value.tv_nsec >= 1000000000) {its.it_value.tv_sec++; its.it_value.tv_nsec -= 1000000000;}
+	
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {close(tfd); tfd = -1; return;}
+	watch(tfd);
+}
+
+sample_scheduler::~sample_scheduler(){
+	if (tfd >= 0) close(tfd);
+}
+
+sample_scheduler::operator const bool() const{
+	return (tfd >= 0);
+}
+
+int sample_scheduler::fd() const{
+	return tfd;
+}
+
+void sample_scheduler::reschedule(double delay, double period){
+	itimerspec its;
+	its.it_interval.tv_sec = (time_t)period;
+	its.it_interval.tv_nsec = (long)((period - its.it_interval.tv_sec) * 1e9);
+	its.it_value.tv_sec = (time_t)delay;
+	its.it_value.tv_nsec = (long)((delay - its.it_value.tv_sec) * 1e9);
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1; //0 would disarm it
+	timerfd_settime(tfd, 0, &its, NULL);
+}
+
+void sample_scheduler::align(double period){
+	timespec now; clock_gettime(CLOCK_BOOTTIME, &now);
+	double next = (floor((now.tv_sec + now.tv_nsec / 1e9) / period) + 1) * period;
+	itimerspec its;
+	its.it_interval.tv_sec = (time_t)period;
+	its.it_interval.tv_nsec = (long)((period - its.it_interval.tv_sec) * 1e9);
+	its.it_value.tv_sec = (time_t)next;
+	its.it_value.tv_nsec = (long)((next - its.it_value.tv_sec) * 1e9);
+	timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+void sample_scheduler::watch(int fd){
+	pollfd pfd; pfd.fd = fd; pfd.events = POLLIN; pfd.revents = 0;
+	pfds.push_back(pfd);
+}
+
+unsigned long sample_scheduler::wait(){
+	while (poll(pfds.data(), pfds.size(), -1) < 0)
+		if (errno != EINTR) return 0;
+	
+	uint64_t expirations = 0;
+	if (pfds[0].revents & POLLIN)
+		if (read(tfd, &expirations, sizeof(expirations)) < 0) expirations = 0;
+	return expirations;
+}
+
+bool sample_scheduler::readable(int fd) const{
+	for (unsigned int i = 0; i < pfds.size(); i++)
+		if (pfds[i].fd == fd) return (pfds[i].revents & POLLIN) != 0;
+	return false;
+}
+
+// receives uevents sent by the kernel (not those relayed by udevd) for the power_supply subsystem.
+// in most cases, the driver sends a 'change' event when the charging status or the capacity changes.
+class uevent_listener {
+	int sfd;
+public:
+	uevent_listener();
+	uevent_listener(const uevent_listener&) = delete;
+	~uevent_listener();
+	operator const bool() const;
+	
+	int fd() const;
+	bool receive(); //reads all pending uevents, returns true if any of them is about power_supply
+};
+
+uevent_listener::uevent_listener(){
+	sfd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+	if (sfd < 0) return;
+	
+	sockaddr_nl addr; memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = 0; //assigned by the kernel
+	addr.nl_groups = 1; //multicast group of kernel uevents
+	if (bind(sfd, (sockaddr*)&addr, sizeof(addr)) != 0) {close(sfd); sfd = -1;}
+}
+
+uevent_listener::~uevent_listener(){
+	if (sfd >= 0) close(sfd);
+}
+
+uevent_listener::operator const bool() const{
+	return (sfd >= 0);
+}
+
+int uevent_listener::fd() const{
+	return sfd;
+}
+
+bool uevent_listener::receive(){
+	static char buf[8192]; //not on stack. a uevent is "ACTION@DEVPATH\0KEY=VALUE\0KEY=VALUE\0..."
+	const char* subsystem = "SUBSYSTEM=power_supply";
+	bool found = false;
+	
+	ssize_t n;
+	while ((n = recv(sfd, buf, sizeof(buf) - 1, 0)) > 0){
+		buf[n] = '\0';
+		for (char* p = buf; p < buf + n; p += strlen(p) + 1)
+			if (strcmp(p, subsystem) == 0) {found = true; break;}
+	}
+	return found;
 }
 
 struct poweralarmconfig{
+	string battery; //name of the battery this section is for, empty for the default section
 	bool manualswitch = false; // It should be true in case of the power gauge don't know if it is charging,
 							   // and the current equals that of computer circuit.
 	float ir; //internal resistance
 	float minvoltage;
 	float maxvoltage;
 	float maxpower;
+	float maxtemperature; //(°C) of the temp attribute, 0 to disable the alarm
+	float interval; //sampling period (s), not less than min_interval
+	bool eventdriven; //sample immediately on uevents of power_supply, and sample every idleinterval otherwise
+	float idleinterval;
+	bool binarylog; //complete logs are written continuously in binary_log format, instead of text at the end
+	bool history; //readings of the session are kept in memory, for complete text logs
+	float rawhistory; //(min) raw readings kept in memory, older ones are kept as aggregates. 0: as many as fit
+	string alarmcommand; //run by /bin/sh when an alarm begins in daemon mode, empty for syslog only
+	string querysocket; //path of the unix socket of query_server, empty if it is disabled (default section only)
+	string metricslisten; //"ADDRESS:PORT" of the HTTP metrics endpoint, empty if it is disabled (default section only)
+	string fleetcollector; unsigned int fleetbatch; //"HOST:PORT" of the collector, see fleet_sender (default section only)
+	unsigned int logsyncrecords; float logsyncinterval; //durability of text logs, see log_writer, 0 means never
+	unsigned int logrotatesize; float logrotatedays; unsigned int logrotatecount; //rotation of stat.log, size in KB
+	float voltagehysteresis, powerhysteresis; //(V, W) an alarm is cleared after the value is back in range by this
+	float alarmdelay; //(s) an alarm is made after the value is out of range for this time
+	float alarmrepeat; //(s) least time between notifications of an alarm, 0 for every reading
+	float lowruntime; //(min) warn once per session when the predicted time to empty is less, 0 to disable
+	bool adaptiveir; //ir is estimated from the readings continuously (see ir_estimator), and saved at the end
+	string iiodevice, iiovoltage, iiocurrent, iiotrigger; //IIO buffer of fast readings, empty device to disable
+	bool adaptiveinterval; //duplicate readings are dropped, and the sampling follows updates of the gauge (default section only)
+	bool greenmode; //fewer wakeups of the program, see green_setup() (default section only)
+	bool iouring; //the attributes of all batteries are read in one batch, see sysfs_ring (default section only)
+	
+	static constexpr float min_interval = 0.01;
 	
 	poweralarmconfig();
 	void reset();
@@ -281,43 +1479,466 @@ struct poweralarmconfig{
 
 poweralarmconfig::poweralarmconfig() {reset();}
 void poweralarmconfig::reset(){
-	ir = 0.1; minvoltage = 3.8; maxvoltage = 4.1; maxpower = 5;
+	ir = 0.1; minvoltage = 3.8; maxvoltage = 4.1; maxpower = 5; maxtemperature = 0; interval = 5;
+	eventdriven = false; idleinterval = 60; binarylog = false; history = true; rawhistory = 0;
+	alarmcommand = ""; querysocket = ""; metricslisten = ""; fleetcollector = ""; fleetbatch = 12;
+	logsyncrecords = 0; logsyncinterval = 0; logrotatesize = 0; logrotatedays = 0; logrotatecount = 5;
+	voltagehysteresis = powerhysteresis = 0; alarmdelay = alarmrepeat = 0; adaptiveir = false;
+	lowruntime = 0;
+	adaptiveinterval = false; greenmode = false; iouring = false;
+	iiodevice = ""; iiovoltage = "in_voltage0"; iiocurrent = "in_current0"; iiotrigger = "";
 }
 	
 string poweralarmconfig::usrstr(){
 	string str = "";
+	if (battery != "") str += "[" + battery + "]\n";
 	str += "Manual Switch: ";
 	str += (manualswitch? "Enabled\n":"Disabled\n");
 	str += "Internal Resistance: " + float_str(ir) + " Ω\n"
 		 + "Proper Range: \n"
          + "  Min Voltage: " + float_str(minvoltage) + " V\n"
          + "  Max Voltage: " + float_str(maxvoltage) + " V\n"
-         + "  Max Power: " + float_str(maxpower) + " W\n";
+         + "  Max Power: " + float_str(maxpower) + " W\n"
+         + (maxtemperature > 0? "  Max Temperature: " + float_str(maxtemperature, 1) + " °C\n" : "")
+	     + "Sample Interval: " + float_str(interval) + " s\n";
+	if (eventdriven)
+		str += "Event Driven: Enabled (Idle Interval: " + float_str(idleinterval) + " s)\n";
+	if (adaptiveinterval)
+		str += "Adaptive Interval: Enabled (up to " + float_str(idleinterval) + " s)\n";
+	if (greenmode)
+		str += "Green Mode: Enabled\n";
+	if (iouring)
+		str += "io_uring: Enabled\n";
+	if (binarylog)
+		str += "Binary Log: Enabled\n";
+	if (! history)
+		str += "History: Disabled\n";
+	else if (rawhistory > 0)
+		str += "Raw History: " + float_str(rawhistory) + " min\n";
+	if (alarmcommand != "")
+		str += "Alarm Command: " + alarmcommand + "\n";
+	if (querysocket != "")
+		str += "Query Socket: " + querysocket + "\n";
+	if (metricslisten != "")
+		str += "Metrics: http://" + metricslisten + "/metrics\n";
+	if (fleetcollector != "")
+		str += "Fleet Collector: " + fleetcollector + " (" + to_string(fleetbatch) + " readings per batch)\n";
+	if (adaptiveir)
+		str += "Adaptive Internal Resistance: Enabled\n";
+	if (iiodevice != "")
+		str += "IIO Buffer: " + iiodevice + " (" + iiovoltage + ", " + iiocurrent
+		     + (iiotrigger != ""? ", trigger " + iiotrigger : "") + ")\n";
+	if (voltagehysteresis > 0 || powerhysteresis > 0)
+		str += "Alarm Hysteresis: " + float_str(voltagehysteresis) + " V, " + float_str(powerhysteresis) + " W\n";
+	if (alarmdelay > 0 || alarmrepeat > 0)
+		str += "Alarm Delay: " + float_str(alarmdelay) + " s, Repeat: " + float_str(alarmrepeat) + " s\n";
+	if (lowruntime > 0)
+		str += "Low Runtime Warning: " + float_str(lowruntime) + " min\n";
+	if (logsyncrecords > 0 || logsyncinterval > 0)
+		str += "Log Sync: every " + (logsyncrecords > 0? to_string(logsyncrecords) + " records" : "")
+		     + (logsyncrecords > 0 && logsyncinterval > 0? " or " : "")
+		     + (logsyncinterval > 0? float_str(logsyncinterval) + " s" : "") + "\n";
+	if (logrotatesize > 0 || logrotatedays > 0)
+		str += "Log Rotation: " + (logrotatesize > 0? to_string(logrotatesize) + " KB" : "")
+		     + (logrotatesize > 0 && logrotatedays > 0? " or " : "")
+		     + (logrotatedays > 0? float_str(logrotatedays) + " days" : "")
+		     + " (keeps " + to_string(logrotatecount) + " files)\n";
 	return str;
 }
 
 ostream& operator<< (ostream& os, poweralarmconfig& c){ // & means pass by reference
 	os.setf(ios::fixed); os.precision(3);
-	os << "[PowerAlarmConfig]\nManualSwitch = " << c.manualswitch << "\nInternalResistance = "
+	os << ((c.battery == "")? "[PowerAlarmConfig]" : "[PowerAlarmConfig:" + c.battery + "]")
+	   << "\nManualSwitch = " << c.manualswitch << "\nInternalResistance = "
 	   << c.ir << "\nMinVoltage = " << c.minvoltage << "\nMaxVoltage = " << c.maxvoltage
-	   << "\nMaxPower = " << c.maxpower << '\n';
+	   << "\nMaxPower = " << c.maxpower << "\nMaxTemperature = " << c.maxtemperature << "\nSampleInterval = " << c.interval
+	   << "\nEventDriven = " << c.eventdriven << "\nIdleInterval = " << c.idleinterval
+	   << "\nBinaryLog = " << c.binarylog << "\nHistory = " << c.history << "\nRawHistory = " << c.rawhistory
+	   << "\nLogSyncRecords = " << c.logsyncrecords << "\nLogSyncInterval = " << c.logsyncinterval
+	   << "\nLogRotateSize = " << c.logrotatesize << "\nLogRotateDays = " << c.logrotatedays
+	   << "\nLogRotateCount = " << c.logrotatecount
+	   << "\nVoltageHysteresis = " << c.voltagehysteresis << "\nPowerHysteresis = " << c.powerhysteresis
+	   << "\nAlarmDelay = " << c.alarmdelay << "\nAlarmRepeat = " << c.alarmrepeat
+	   << "\nLowRuntimeWarning = " << c.lowruntime
+	   << "\nAdaptiveIR = " << c.adaptiveir << "\nAdaptiveInterval = " << c.adaptiveinterval
+	   << "\nGreenMode = " << c.greenmode << "\nIOUring = " << c.iouring << "\nFleetBatch = " << c.fleetbatch << '\n';
+	if (c.alarmcommand != "") os << "AlarmCommand = " << c.alarmcommand << '\n';
+	if (c.querysocket != "") os << "QuerySocket = " << c.querysocket << '\n';
+	if (c.metricslisten != "") os << "MetricsListen = " << c.metricslisten << '\n';
+	if (c.fleetcollector != "") os << "FleetCollector = " << c.fleetcollector << '\n';
+	if (c.iiodevice != "") os << "IIODevice = " << c.iiodevice << "\nIIOVoltage = " << c.iiovoltage
+	                          << "\nIIOCurrent = " << c.iiocurrent << '\n';
+	if (c.iiotrigger != "") os << "IIOTrigger = " << c.iiotrigger << '\n';
 	return os;
 }
-istream& operator>> (istream& is, poweralarmconfig& c){
+// reads " = value" of the key that has been read from is. returns false if the key is unknown
+bool read_config_key(istream& is, const string& key, poweralarmconfig& c){
 	string tmp;
-	is >> tmp;
-	if (tmp == "[PowerAlarmConfig]"){ //merely usable, because of the spaces left and right of '='
-		is >> tmp >> tmp >> c.manualswitch
-		   >> tmp >> tmp >> c.ir
-		   >> tmp >> tmp >> c.minvoltage
-		   >> tmp >> tmp >> c.maxvoltage
-		   >> tmp >> tmp >> c.maxpower;
-	} else {
-		is.clear(ios::badbit);
+	if (key == "ManualSwitch")
+		is >> tmp >> c.manualswitch;
+	else if (key == "InternalResistance")
+		is >> tmp >> c.ir;
+	else if (key == "MinVoltage")
+		is >> tmp >> c.minvoltage;
+	else if (key == "MaxVoltage")
+		is >> tmp >> c.maxvoltage;
+	else if (key == "MaxPower")
+		is >> tmp >> c.maxpower;
+	else if (key == "MaxTemperature")
+		is >> tmp >> c.maxtemperature;
+	else if (key == "SampleInterval")
+		is >> tmp >> c.interval;
+	else if (key == "EventDriven")
+		is >> tmp >> c.eventdriven;
+	else if (key == "IdleInterval")
+		is >> tmp >> c.idleinterval;
+	else if (key == "BinaryLog")
+		is >> tmp >> c.binarylog;
+	else if (key == "History")
+		is >> tmp >> c.history;
+	else if (key == "RawHistory")
+		is >> tmp >> c.rawhistory;
+	else if (key == "AlarmCommand"){ //the rest of the line, which may contain spaces
+		is >> tmp; getline(is, c.alarmcommand);
+		c.alarmcommand.erase(0, c.alarmcommand.find_first_not_of(" \t"));
+	}
+	else if (key == "QuerySocket")
+		is >> tmp >> c.querysocket;
+	else if (key == "MetricsListen")
+		is >> tmp >> c.metricslisten;
+	else if (key == "FleetCollector")
+		is >> tmp >> c.fleetcollector;
+	else if (key == "FleetBatch")
+		is >> tmp >> c.fleetbatch;
+	else if (key == "LogSyncRecords")
+		is >> tmp >> c.logsyncrecords;
+	else if (key == "LogSyncInterval")
+		is >> tmp >> c.logsyncinterval;
+	else if (key == "LogRotateSize")
+		is >> tmp >> c.logrotatesize;
+	else if (key == "LogRotateDays")
+		is >> tmp >> c.logrotatedays;
+	else if (key == "LogRotateCount")
+		is >> tmp >> c.logrotatecount;
+	else if (key == "VoltageHysteresis")
+		is >> tmp >> c.voltagehysteresis;
+	else if (key == "PowerHysteresis")
+		is >> tmp >> c.powerhysteresis;
+	else if (key == "AlarmDelay")
+		is >> tmp >> c.alarmdelay;
+	else if (key == "AlarmRepeat")
+		is >> tmp >> c.alarmrepeat;
+	else if (key == "LowRuntimeWarning")
+		is >> tmp >> c.lowruntime;
+	else if (key == "AdaptiveIR")
+		is >> tmp >> c.adaptiveir;
+	else if (key == "AdaptiveInterval")
+		is >> tmp >> c.adaptiveinterval;
+	else if (key == "GreenMode")
+		is >> tmp >> c.greenmode;
+	else if (key == "IOUring")
+		is >> tmp >> c.iouring;
+	else if (key == "IIODevice")
+		is >> tmp >> c.iiodevice;
+	else if (key == "IIOVoltage")
+		is >> tmp >> c.iiovoltage;
+	else if (key == "IIOCurrent")
+		is >> tmp >> c.iiocurrent;
+	else if (key == "IIOTrigger")
+		is >> tmp >> c.iiotrigger;
+	else
+		return false;
+	return true;
+}
+
+static string trim_str(const string& str){
+	size_t b = str.find_first_not_of(" \t\r"), e = str.find_last_not_of(" \t\r");
+	return (b == string::npos)? "" : str.substr(b, e - b + 1);
+}
+
+// reads a section: "[PowerAlarmConfig]" or "[PowerAlarmConfig:BAT1]", then "Key = Value" lines in any order
+// until the next header. spaces around '=' are optional, blank lines and lines beginning with '#' or ';' are
+// skipped, and unknown keys (e.g. of later versions) are ignored. keys not given are those of base. the keys
+// of version 1.18 are required in the default section. invalid lines are described in errors.
+bool read_config_section(istream& is, poweralarmconfig& c, const poweralarmconfig& base, string* errors){
+	string line;
+	while (getline(is, line)){
+		line = trim_str(line);
+		if (line != "" && line[0] != '#' && line[0] != ';') break;
+	}
+	const string header = "[PowerAlarmConfig";
+	if (! is || line.compare(0, header.length(), header) != 0 || line.back() != ']') return false;
+	c = base;
+	c.battery = (line.length() > header.length() + 2 && line[header.length()] == ':')?
+	            line.substr(header.length() + 1, line.length() - header.length() - 2) : "";
+	
+	static const char* required[] = {"ManualSwitch", "InternalResistance", "MinVoltage", "MaxVoltage", "MaxPower"};
+	unsigned int found = 0;
+	while ((is >> ws) && ! is.eof() && is.peek() != '['){
+		getline(is, line); line = trim_str(line);
+		if (line == "" || line[0] == '#' || line[0] == ';') continue;
+		size_t eq = line.find('=');
+		if (eq == string::npos) {if (errors) *errors += "no '=' in \"" + line + "\"\n"; continue;}
+		string key = trim_str(line.substr(0, eq));
+		istringstream iss("= " + trim_str(line.substr(eq + 1)));
+		poweralarmconfig test = c; //the value is kept if the new one is invalid
+		if (! read_config_key(iss, key, test)) continue;
+		if (iss.fail()) {if (errors) *errors += "invalid value in \"" + line + "\"\n"; continue;}
+		c = test;
+		for (unsigned int k = 0; k < 5; k++)
+			if (key == required[k]) found |= 1 << k;
 	}
+	if (c.battery == "" && found != 0x1f) {if (errors) *errors += "keys of version 1.18 are missing\n"; return false;}
+	if (c.interval < poweralarmconfig::min_interval) c.interval = poweralarmconfig::min_interval;
+	if (c.idleinterval < c.interval) c.idleinterval = c.interval;
+	return true;
+}
+
+istream& operator>> (istream& is, poweralarmconfig& c){
+	if (! read_config_section(is, c, poweralarmconfig(), NULL)) is.clear(ios::badbit);
 	return is;
 }
 
+// keys which can be changed while running (see reloadconfig()), copied from c into to
+void copy_reloadable(poweralarmconfig& to, const poweralarmconfig& c){
+	to.ir = c.ir; to.minvoltage = c.minvoltage; to.maxvoltage = c.maxvoltage; to.maxpower = c.maxpower;
+	to.maxtemperature = c.maxtemperature;
+	to.interval = c.interval; to.idleinterval = c.idleinterval; to.alarmcommand = c.alarmcommand;
+	to.logsyncrecords = c.logsyncrecords; to.logsyncinterval = c.logsyncinterval;
+	to.logrotatesize = c.logrotatesize; to.logrotatedays = c.logrotatedays; to.logrotatecount = c.logrotatecount;
+	to.voltagehysteresis = c.voltagehysteresis; to.powerhysteresis = c.powerhysteresis;
+	to.alarmdelay = c.alarmdelay; to.alarmrepeat = c.alarmrepeat; to.lowruntime = c.lowruntime;
+}
+
+// an append-only file of packed_reading records following a header, written through mmap().
+// the file is extended by chunks, and the record count in the header is updated on each append,
+// so that the readings written before are kept if the program is killed.
+struct binary_log_header { //80 B
+	char magic[8]; //"SBVALOG"
+	uint32_t version; uint32_t recordsize;
+	uint64_t count; //of records
+	int64_t basetime; double basemtime; //dtime of the records are relative to them
+	char battery[16];
+	float ir, minvoltage, maxvoltage, maxpower, interval;
+	uint8_t manualswitch, charging, reserved[2];
+	
+	static const uint32_t current_version = 1;
+};
+
+class binary_log {
+	int fd; string fname;
+	char* map; size_t mapsize;
+	binary_log_header* header;
+	
+	static const size_t chunk = 0x10000 * sizeof(packed_reading); //1 MB
+	bool extend();
+public:
+	binary_log();
+	binary_log(const binary_log&) = delete;
+	~binary_log();
+	operator const bool() const;
+	
+	// the config is written into the header, first gives the base time
+	bool open(string filename, const string& battery, const poweralarmconfig& c, const power_reading& first);
+	bool append(const power_reading& r);
+	void close(); //truncates the file to the used size
+	string filename() const;
+};
+
+binary_log::binary_log(): fd(-1), map(NULL), mapsize(0), header(NULL) {}
+
+binary_log::~binary_log(){
+	close();
+}
+
+binary_log::operator const bool() const{
+	return (header != NULL);
+}
+
+string binary_log::filename() const{
+	return fname;
+}
+
+bool binary_log::extend(){
+	size_t newsize = mapsize + chunk;
+	if (ftruncate(fd, newsize) != 0) return false;
+	void* p = (map == NULL)? mmap(NULL, newsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+	                       : mremap(map, mapsize, newsize, MREMAP_MAYMOVE);
+	if (p == MAP_FAILED) return false;
+	map = (char*)p; mapsize = newsize;
+	header = (binary_log_header*)map;
+	return true;
+}
+
+bool binary_log::open(string filename, const string& battery, const poweralarmconfig& c, const power_reading& first){
+	close();
+	fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) return false;
+	if (! extend()) {close(); return false;}
+	fname = filename;
+	
+	memset(header, 0, sizeof(binary_log_header));
+	memcpy(header->magic, "SBVALOG", 8);
+	header->version = binary_log_header::current_version;
+	header->recordsize = sizeof(packed_reading);
+	header->basetime = first.time; header->basemtime = first.mtime;
+	strncpy(header->battery, battery.c_str(), sizeof(header->battery) - 1);
+	header->ir = c.ir; header->minvoltage = c.minvoltage; header->maxvoltage = c.maxvoltage;
+	header->maxpower = c.maxpower; header->interval = c.interval;
+	header->manualswitch = c.manualswitch; header->charging = first.charging;
+	return true;
+}
+
+bool binary_log::append(const power_reading& r){
+	if (! header) return false;
+	double dt = (r.mtime - header->basemtime) * 1000;
+	if (dt < 0 || dt > numeric_limits<uint32_t>::max()) return false;
+	
+	size_t offset = sizeof(binary_log_header) + header->count * sizeof(packed_reading);
+	if (offset + sizeof(packed_reading) > mapsize && ! extend()) return false;
+	
+	*(packed_reading*)(map + offset) = packed_reading::pack(r, header->basemtime);
+	header->count++; //after the record is written
+	return true;
+}
+
+void binary_log::close(){
+	if (header){
+		size_t used = sizeof(binary_log_header) + header->count * sizeof(packed_reading);
+		munmap(map, mapsize);
+		ftruncate(fd, used);
+	}
+	if (fd >= 0) ::close(fd);
+	fd = -1; map = NULL; mapsize = 0; header = NULL;
+}
+
+// a text log kept open, to which records are appended in batches. the batch is written by flush(), which
+// is called once per wakeup of the output thread. durability and rotation follow the config:
+// fdatasync() after every logsyncrecords records and/or every logsyncinterval seconds (never by default);
+// the file is renamed to FILE.1 (FILE.1 to FILE.2, etc.) when it exceeds logrotatesize KB or logrotatedays.
+class log_writer {
+	int fd; string fname;
+	string batch; //appended but not written
+	size_t size; //of the file, excluding the batch
+	unsigned int unsynced; double lastsync; //records written since last fdatasync(), monotonic_now() of it
+	time_t started; //creation time of the file
+	bool rotation;
+	
+	unsigned int syncrecords; double syncinterval;
+	size_t rotatesize; double rotateage; unsigned int rotatecount;
+	
+	bool reopen();
+	void rotate();
+public:
+	log_writer();
+	log_writer(const log_writer&) = delete;
+	~log_writer();
+	operator const bool() const;
+	
+	bool open(const string& filename, const poweralarmconfig& c, bool rotate);
+	void setpolicy(const poweralarmconfig& c); //of syncing and rotation
+	void append(const char* p, size_t n);
+	void append(const string& str);
+	bool flush(); //writes the batch, then syncs and rotates if it is time to
+	void close(); //flushes, and syncs if any sync policy is set
+	const string& filename() const;
+};
+
+log_writer::log_writer(): fd(-1), size(0), unsynced(0), lastsync(0), started(0), rotation(false) {}
+
+log_writer::~log_writer(){
+	close();
+}
+
+log_writer::operator const bool() const{
+	return (fd >= 0);
+}
+
+bool log_writer::open(const string& filename, const poweralarmconfig& c, bool rotate){
+	close();
+	fname = filename; rotation = rotate;
+	setpolicy(c);
+	return reopen();
+}
+
+void log_writer::setpolicy(const poweralarmconfig& c){
+	syncrecords = c.logsyncrecords; syncinterval = c.logsyncinterval;
+	rotatesize = (size_t)c.logrotatesize * 1024; rotateage = c.logrotatedays * 86400.0; rotatecount = c.logrotatecount;
+}
+
+bool log_writer::reopen(){
+	fd = ::open(fname.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) return false;
+	
+	struct statx sx; //the birth time isn't provided by stat()
+	started = time(NULL); size = 0;
+	if (statx(fd, "", AT_EMPTY_PATH, STATX_SIZE | STATX_BTIME | STATX_MTIME, &sx) == 0){
+		size = sx.stx_size;
+		if (size > 0) started = (sx.stx_mask & STATX_BTIME)? sx.stx_btime.tv_sec : sx.stx_mtime.tv_sec;
+	}
+	unsynced = 0; lastsync = monotonic_now();
+	return true;
+}
+
+void log_writer::append(const char* p, size_t n){
+	batch.append(p, n);
+	unsynced++;
+	if (batch.length() >= 0x10000) flush(); //64 KB
+}
+
+void log_writer::append(const string& str){
+	append(str.data(), str.length());
+}
+
+bool log_writer::flush(){
+	if (fd < 0) return false;
+	
+	size_t written = 0;
+	while (written < batch.length()){
+		ssize_t r = write(fd, batch.data() + written, batch.length() - written);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) break;
+		written += r;
+	}
+	size += written; batch.erase(0, written);
+	
+	if (unsynced > 0 && (   (syncrecords > 0 && unsynced >= syncrecords)
+	                     || (syncinterval > 0 && monotonic_now() - lastsync >= syncinterval))){
+		fdatasync(fd);
+		unsynced = 0; lastsync = monotonic_now();
+	}
+	
+	if (rotation && batch.empty() && size > 0
+	&&  ((rotatesize > 0 && size >= rotatesize) || (rotateage > 0 && difftime(time(NULL), started) >= rotateage)))
+		rotate();
+	return batch.empty();
+}
+
+void log_writer::rotate(){
+	if (unsynced > 0 && (syncrecords > 0 || syncinterval > 0)) fdatasync(fd);
+	::close(fd); fd = -1;
+	if (rotatecount == 0)
+		unlink(fname.c_str());
+	else {
+		for (unsigned int i = rotatecount - 1; i >= 1; i--) //the oldest one is overwritten
+			rename((fname + '.' + to_string(i)).c_str(), (fname + '.' + to_string(i + 1)).c_str());
+		rename(fname.c_str(), (fname + ".1").c_str());
+	}
+	reopen();
+}
+
+void log_writer::close(){
+	if (fd < 0) return;
+	flush();
+	if (unsynced > 0 && (syncrecords > 0 || syncinterval > 0)) fdatasync(fd);
+	::close(fd); fd = -1;
+	batch.clear();
+}
+
+const string& log_writer::filename() const{
+	return fname;
+}
+
 // default working folder will be ~ ($HOME) after chdir by getconfig(),
 // while ofstream::open(char*) and system(char*) are being called
 const string config_entry = "simple-battery-voltage-alarm";
@@ -325,14 +1946,100 @@ const string config_filename = "version_1_18.conf";
 const string stat_filename = "stat.log";
 
 string working_folder;
-poweralarmconfig config;
+poweralarmconfig config; //default section, also decides the sampling period
+bool daemon_mode = false; //-d parameter: no console input, alarms and statistics go to syslog
+bool console_output = true; //readings are written on the console (not in daemon mode), see green_setup()
+log_writer statlog; //stat_filename, shared by all batteries, used by the output thread
+vector<poweralarmconfig> battery_configs; //sections of specific batteries, in case of multiple batteries
+
+poweralarmconfig battery_config(string name){
+	for (unsigned int i = 0; i < battery_configs.size(); i++)
+		if (battery_configs[i].battery == name) return battery_configs[i];
+	poweralarmconfig c = config; c.battery = name;
+	return c;
+}
+
+// writes config and battery_configs into a temporary file, which replaces the config file then
+bool saveconfig(){
+	string tmpname = config_filename + ".tmp";
+	ofstream ofs(tmpname);
+	if (! ofs) return false;
+	ofs << config;
+	for (unsigned int i = 0; i < battery_configs.size(); i++)
+		ofs << '\n' << battery_configs[i];
+	ofs << endl;
+	ofs.close();
+	if (! ofs || rename(tmpname.c_str(), config_filename.c_str()) != 0) {remove(tmpname.c_str()); return false;}
+	return true;
+}
+
+// sets ir of the battery's own section, which is created in case of it doesn't exist
+void set_battery_ir(const string& name, float ir){
+	for (unsigned int i = 0; i < battery_configs.size(); i++)
+		if (battery_configs[i].battery == name) {battery_configs[i].ir = ir; return;}
+	if (battery_configs.empty() && find_power_supplies().size() <= 1) {config.ir = ir; return;}
+	battery_configs.push_back(battery_config(name));
+	battery_configs.back().ir = ir;
+}
+
+// writes ir of config and battery_configs (see set_battery_ir()) into the InternalResistance lines of the
+// config file, copying the other lines (comments, unknown keys) unchanged. a battery section without the key
+// gets it after its header if its ir isn't that of the default section, and new sections are appended.
+bool save_config_ir(){
+	ifstream ifs(config_filename);
+	if (! ifs) return saveconfig();
+	const string header = "[PowerAlarmConfig", key = "InternalResistance";
+	vector<string> lines; vector<bool> written(battery_configs.size(), false);
+	const poweralarmconfig* section = NULL; size_t headerline = 0; bool haskey = true;
+	string line;
+	for (bool more = true; more; ){
+		more = (bool)getline(ifs, line);
+		string t = trim_str(line);
+		bool isheader = more && t.compare(0, header.length(), header) == 0 && t.back() == ']';
+		if (isheader || ! more){ //the end of the previous section
+			if (section && ! haskey && fabs(section->ir - config.ir) >= 0.0005)
+				lines.insert(lines.begin() + headerline + 1, key + " = " + float_str(section->ir));
+			if (! more) break;
+			string name = (t.length() > header.length() + 2 && t[header.length()] == ':')?
+			              t.substr(header.length() + 1, t.length() - header.length() - 2) : "";
+			section = (name == "")? &config : NULL;
+			for (unsigned int i = 0; i < battery_configs.size(); i++)
+				if (name != "" && battery_configs[i].battery == name) {section = &battery_configs[i]; written[i] = true;}
+			headerline = lines.size(); haskey = false;
+		} else if (section && t != "" && t[0] != '#' && t[0] != ';'){
+			size_t eq = t.find('=');
+			if (eq != string::npos && trim_str(t.substr(0, eq)) == key){
+				haskey = true;
+				if (fabs(atof(t.c_str() + eq + 1) - section->ir) >= 0.0005) line = key + " = " + float_str(section->ir);
+			}
+		}
+		lines.push_back(line);
+	}
+	ifs.close();
+	
+	string tmpname = config_filename + ".tmp";
+	ofstream ofs(tmpname);
+	if (! ofs) return false;
+	for (unsigned int i = 0; i < lines.size(); i++) ofs << lines[i] << '\n';
+	for (unsigned int i = 0; i < battery_configs.size(); i++)
+		if (! written[i]) ofs << '\n' << battery_configs[i];
+	ofs.close();
+	if (! ofs || rename(tmpname.c_str(), config_filename.c_str()) != 0) {remove(tmpname.c_str()); return false;}
+	return true;
+}
 
 bool setconfig(){
-	power_status_reader testrd(false, 0);
-	if (! testrd) {
+	vector<unique_ptr<power_status_reader>> testrds;
+	vector<string> devicepaths = find_power_supplies();
+	for (unsigned int i = 0; i < devicepaths.size(); i++){
+		testrds.emplace_back(new power_status_reader(devicepaths[i], false, 0));
+		if (! *testrds.back()) testrds.pop_back();
+	}
+	if (testrds.empty()) {
 		cout << "Sorry: Failed to find device file. Maybe this program don't support your computer.\n";
 		return false;
 	}
+	bool multiple = (testrds.size() > 1);
 	
 	cout << "simple-battery-voltage-alarm Version 1.18\n"
 		 << "\tThis program checks for battery voltage and makes "
@@ -364,45 +2071,63 @@ bool setconfig(){
 			 << "you can edit /etc/UPower/UPower.conf in Recovery mode "
 			 << "if you have encountered the auto power-off problem.\n";
 	
-	string tech = testrd.technology(); float maxvol = testrd.maxvoltage();	
-	if (tech != "") cout << "\tBattery technology: " << tech << '\n';
-	if (tech == "Li-ion")
-	     cout << "\tIt might be 18650 in a notebook, or polymer in a tablet.\n";
-	else cout << "\tThis program is made for Li-ion batteries, "
-	          << "it might be improper for your kind of battery.\n";
-	if (maxvol > 0) cout << "\tDesigned Max Voltage: " << maxvol << " V\n";
+	for (unsigned int i = 0; i < testrds.size(); i++){
+		string tech = testrds[i]->technology(); float maxvol = testrds[i]->maxvoltage();
+		if (multiple) cout << "\tBattery " << testrds[i]->devicename() << ":\n";
+		if (tech != "") cout << "\tBattery technology: " << tech << '\n';
+		if (tech == "Li-ion")
+		     cout << "\tIt might be 18650 in a notebook, or polymer in a tablet.\n";
+		else cout << "\tThis program is made for Li-ion batteries, "
+		          << "it might be improper for your kind of battery.\n";
+		if (maxvol > 0) cout << "\tDesigned Max Voltage: " << maxvol << " V\n";
+	}
 	cout << '\n';
 		
 	// a DC method of measuring internal resistance, not very accurate.
 	// reference formula: U1 = E - I1*r, U2 = E - I2*r.
-	float U1, I1, U2, I2, r; //reference directions of I1 and I2 here are in the direction of discharging
+	// all batteries are sampled at the same moments, each of them gets its own r.
+	unsigned int n = testrds.size();
+	vector<float> U1(n), I1(n), U2(n), I2(n); float r; //reference directions of I1 and I2 here are in the direction of discharging
 	power_reading tmprecord;
-	cout << "\tWe'll measure the internal resitance of the battery.\n";
+	cout << "\tWe'll measure the internal resitance of the batter" << (multiple? "ies" : "y") << ".\n";
 	if (config.manualswitch){
 		cout << "\tPlease make sure you're Discharging, then press Enter to continue...";
 		cpause();
 	}
-	tmprecord = testrd.read(); U1 = tmprecord.voltage; I1 = -tmprecord.current;
-	cout << "\tSample 1: " << U1 << " V, " << I1 << " A.\n";
+	for (unsigned int i = 0; i < n; i++){
+		tmprecord = testrds[i]->read(); U1[i] = tmprecord.voltage; I1[i] = -tmprecord.current;
+	}
+	for (unsigned int i = 0; i < n; i++)
+		cout << "\t" << (multiple? testrds[i]->devicename() + " " : "")
+		     << "Sample 1: " << U1[i] << " V, " << I1[i] << " A.\n";
 			
 	cout << "\tPlease do somthing to make the current change"
 		 << (config.manualswitch? " (but make sure it is Discharging)" : "")
 		 << ", then press Enter to continue...";
 	cpause();
 	
-	tmprecord = testrd.read(); U2 = tmprecord.voltage; I2 = -tmprecord.current;
-	cout << "\tSample 2: " << U2 << " V, " << I2 << " A.\n";
+	for (unsigned int i = 0; i < n; i++){
+		tmprecord = testrds[i]->read(); U2[i] = tmprecord.voltage; I2[i] = -tmprecord.current;
+	}
+	for (unsigned int i = 0; i < n; i++)
+		cout << "\t" << (multiple? testrds[i]->devicename() + " " : "")
+		     << "Sample 2: " << U2[i] << " V, " << I2[i] << " A.\n";
 	
-	if (abs(I1 - I2) < 0.001)
-		cout << "\tSorry, the current has not changed, r was set to default: " << config.ir << " Ω.\n";
-	else {
-		r = (U2 - U1)/(I1 - I2);
-		cout << "\tr: " << r << " Ω. do you think it's right value? (Y/n) ";
-		if (askyn())
-			config.ir = r;
-		else
-			cout << "\tr was set to default: " << config.ir << " Ω.\n";
+	vector<float> irs(n, config.ir);
+	for (unsigned int i = 0; i < n; i++){
+		string prefix = multiple? testrds[i]->devicename() + " " : "";
+		if (abs(I1[i] - I2[i]) < 0.001)
+			cout << "\t" << prefix << "Sorry, the current has not changed, r was set to default: " << config.ir << " Ω.\n";
+		else {
+			r = (U2[i] - U1[i])/(I1[i] - I2[i]);
+			cout << "\t" << prefix << "r: " << r << " Ω. do you think it's right value? (Y/n) ";
+			if (askyn())
+				irs[i] = r;
+			else
+				cout << "\tr was set to default: " << config.ir << " Ω.\n";
+		}
 	}
+	if (! multiple) config.ir = irs[0];
 	cout << '\n';
 	
 	float tmpminv, tmpmaxv, tmpmaxp;
@@ -425,235 +2150,2867 @@ bool setconfig(){
 			 << config.maxvoltage << " V, " << config.maxpower << " W.\n";
 		cin.clear(); cin.ignore(numeric_limits<int>::max(), '\n');
 	} else {config.minvoltage = tmpminv; config.maxvoltage = tmpmaxv; config.maxpower = tmpmaxp;}
-		
+
+	//all batteries get the same thresholds here, they can be changed in the config file
+	battery_configs.clear();
+	if (multiple)
+		for (unsigned int i = 0; i < n; i++){
+			battery_configs.push_back(battery_config(testrds[i]->devicename()));
+			battery_configs.back().ir = irs[i];
+		}
+
 	if (file_readable(config_filename))
 		remove(config_filename.c_str()); //delete damaged config
-	ofstream ofs(config_filename);
-	if (ofs){
-		ofs << config << endl; //save config
+	if (saveconfig())
 		cout << "\n\tConfig saved successfully.\n\n";
-	}
 	
 	return true;
 }
 
-bool getconfig(){
-	bool needconfig = false;
-	
-	working_folder = (string)getenv("HOME") + "/.config/" + config_entry;
+void setworkingfolder(){
+	const char* home = getenv("HOME"); //it may be unset for a service
+	if (home == NULL) {passwd* pw = getpwuid(getuid()); home = pw? pw->pw_dir : "/";}
+	working_folder = (string)home + "/.config/" + config_entry;
 	chdir(working_folder.c_str());
-	if (! file_readable(config_filename)) needconfig = true; //config file not found
-	else{
-		ifstream ifs(config_filename);
-		if (! (ifs >> config)) needconfig = true; //config file damaged
-		else
-			cout << working_folder << '/' << config_filename <<" found:\n" << config.usrstr() << "\n"
-			     << "you can reconfigure the program (recalculate internal resistance) by adding parameter -c.\n";
-		if (ifs.is_open()) ifs.close();
-	}
-	
-	if (needconfig) return setconfig();
-	else return true;
 }
 
-//inputloop() will set these tags for checkloop() to read
-volatile bool tagexit = false, tagcharging = false, tagsavelog = false; 
-
-void checkloop(){
-	const int check_interval = 5; // 5 seconds
+// reads config and battery_configs from the config file, returns false if it's missing or damaged
+bool loadconfig(poweralarmconfig& def, vector<poweralarmconfig>& sections, string* errors){
+	if (! file_readable(config_filename)) return false; //config file not found
+	ifstream ifs(config_filename);
+	if (! read_config_section(ifs, def, poweralarmconfig(), errors) || def.battery != "") return false; //damaged
 	
-	power_status_reader reader(config.manualswitch, config.ir); //creates reader
-	if (! reader) {cout << "Error: Failed to read power status. Press Ctrl+D or Input 'e' to end program... "; return;}
+	poweralarmconfig c; sections.clear();
+	while ((ifs >> ws) && ! ifs.eof()){ //optional sections of specific batteries, keys not given are of def
+		if (! read_config_section(ifs, c, def, errors)) return false;
+		sections.push_back(c);
+	}
+	return true;
+}
 
-	vector<power_reading> readings;
-	float maxW = 0, Wh = 0, mAh = 0, rWh = 0; int otimes = 0; //times of out-of-range readings
-	
-	//current reading, actually discharging (i < 0), seconds between last two readings
-	power_reading creading; bool actuald; time_t dtime;
-	
-	bool first = true; bool pcharging; //first loop, previous status
-	while (true){
-		if (config.manualswitch) reader.charging = tagcharging;
-		creading = reader.read();
-		
-		creading.outofrange = (   creading.voltage < config.minvoltage
-							   || creading.E > config.maxvoltage
-							   || creading.voltage > reader.maxvoltage()
-							   || abs(creading.power()) > config.maxpower);
-		if (creading.outofrange) {
-			bool actuald = !creading.charging || (!config.manualswitch && creading.current < 0);
-			if  ((actuald && creading.voltage < config.minvoltage)
-			  || (creading.voltage > reader.maxvoltage())
-			  || (creading.charging && creading.E > config.maxvoltage)
-			  || abs(creading.power()) > config.maxpower)
-				cout << '\a'; //make alarm sound
-		}
-		
-		if (! first){
-			dtime = difftime(creading.time, readings.back().time); //back() returns last element
-			if (dtime > check_interval * 5) dtime = check_interval * 5; // the program had suspended
-			
-			//both should be positive if it is charging, or minus if it is discharging
-			Wh += readings.back().power() * dtime/3600; 
-			mAh += readings.back().current * 1000 * dtime/3600;
-			
-			// calculate energy wasted on internal resistance, always positive
-			if (!config.manualswitch || !pcharging) //in case of 'manualswitch', rWh can be calculated when discharging
-				rWh += abs((readings.back().E - readings.back().voltage) * readings.back().current) * dtime/3600;
-			
-			// conditions of clearing record: the vector have taken 4 MB of memory,
-			// status changed, the program had suspended in sleeping mode, or the program will end.
-			if  (   readings.size() >= 0x20000
-				 || creading.charging != pcharging
-				 || dtime == check_interval * 5
-				 || tagexit)
-			{
-				if (readings.size() >= 5){ //make statistics
-					if (config.manualswitch){
-						power_reading p15 = readings[readings.size() - 2 - 1]; //read 15 seconds before
-						for (int i = 1; i <= 2; i++) // last two readings can be removed
-							if (abs(readings.back().voltage - p15.voltage) >= 0.1){
-								//such difference should be caused by manual switch delay
-								if (readings.back().outofrange) otimes -= 1; // it doesn't count
-								readings.pop_back();
-							}
-					}
-					
-					time_t span = difftime(readings.back().time, readings.front().time); //(s)
-					int poutrange = otimes*1.0/readings.size() * 100;
-				
-					float dE = readings.back().E - readings.front().E; int dcapacity;
-					if (! config.manualswitch) //percentage of battery remaining capacity is available
-						dcapacity = readings.back().capacity - readings.front().capacity;
-				
-					// W is the charge power of battery, or (minus) discharge power of battery.
-					// but in case of 'manualswitch' and charging, W is (minus) power of computer circuit
-					float W = Wh*3600.0/span;
-					float rW; if (!config.manualswitch || !pcharging) rW = rWh*3600.0/span;
-					float CWh; if (pcharging) CWh = Wh - rWh;
-					float esfullWh; float esfullmAh;
-					if (!config.manualswitch && dcapacity >= 5){ //changed at least 5%
-						if (pcharging)
-							esfullWh = CWh * 100 / dcapacity;
-						else
-							esfullWh = Wh * 100 / dcapacity;
-						esfullmAh = mAh * 100 / dcapacity;
-					}
-					
-					string strstat;
-					strstat = (pcharging? "Charged for ":"Discharged for ") + difftime_str(span) + ", ";
-					if (! config.manualswitch)
-						strstat += to_string(dcapacity) + "% ("
-						         + to_string(readings.front().capacity) + "% -> "
-						         + to_string(readings.back().capacity) + "%), ";
-					strstat += float_str(dE, 3, true) + " V ("
-					         + float_str(readings.front().E) + " V -> "
-					         + float_str(readings.back().E) + " V)\n"
-					         + time_str(readings.front().time) + " ~ " + time_str(readings.back().time)
-					         + " (out of range in " + to_string(poutrange) + "% of time)\n";
-					if (!config.manualswitch || !pcharging)
-						strstat += "Average Power of Battery: " + float_str(W) + " W (Max: " + float_str(maxW) + " W)    "
-						         + "Pr: " + float_str(rW) + " W\n"
-						         + "Charged: " + float_str((Wh > 0)? CWh : Wh, 3, true) + " Wh ("
-						         + float_str(mAh, 0, true) + " mAh)\n";
-					else
-						strstat += "Power of Computer Circuit: " + float_str(abs(W)) + " W\n"
-						         + "Energy cost by Computer Circuit: " + float_str(abs(Wh)) + " Wh ("
-						         + float_str(abs(mAh), 0) + " mAh)\n";
-					if (!config.manualswitch && dcapacity >= 5)
-						strstat += "Full Capacity Estimation: " + float_str(esfullWh) + " Wh ("
-						           + float_str(esfullmAh, 0) + " mAh)\n";
-					
-					cout << '\n' << strstat << '\n';
-				
-					ofstream ofsstat(stat_filename, ios::app); //create or append	
-					if (ofsstat){
-						ofsstat << strstat << endl;
-						ofsstat.close();
-						cout << "appended to log file " << working_folder << '/' << stat_filename << ".\n";
-					}
-					if (tagsavelog){ //save complete log
-						string log_filename = (pcharging? "Charging_" : "Discharging_")
-						                    + time_str(time(NULL),true) + ".log";
-						ofstream ofslog(log_filename);
-						if (ofslog){
-							ofslog << strstat << '\n';
-							for (int i = 0; i < readings.size(); i++)
-								ofslog << readings[i].usrstr(false);
-							ofslog << endl;
-							ofslog.close();
-							cout << "log file " << working_folder << '/' << log_filename << " saved.\n";
-						}
-					}
-					if (! tagexit) cout << '\n';
-				}  else cout << '\n';
-				
-				// swap with a empty temp vector that will be destructed implicitly to release memory usage
-				vector<power_reading>().swap(readings);
-				
-				maxW = 0; Wh = 0; mAh = 0; rWh = 0; otimes = 0;
-				if (tagexit) return;
-			}
-		} else first = false;
-		
-		cout << creading.usrstr();
-		
-		if (abs(creading.power()) > abs(maxW)) maxW = creading.power();
-		if (creading.outofrange) otimes++;
-		
-		//add an item. if previous readings were cleared, it makes sure the vector has at least one item
-		readings.push_back(creading);
-		
-		pcharging = creading.charging;
-		sleep(check_interval); //5 seconds
+bool readconfig(bool verbose){
+	string errors;
+	if (! loadconfig(config, battery_configs, &errors)) return false;
+	if (verbose){
+		if (errors != "") cout << "Warning: ignored in " << config_filename << ":\n" << errors;
+		cout << working_folder << '/' << config_filename <<" found:\n" << config.usrstr();
+		for (unsigned int i = 0; i < battery_configs.size(); i++) cout << battery_configs[i].usrstr();
 	}
+	return true;
 }
 
-void inputloop(){
-	string str;
-	
-	cout << "press Ctrl+D or input 'e' to end the program, input 'l' to enable/disable complete log saving";
-	if (config.manualswitch)
-		cout << ", input 'c'(charging) or 'd'(discharging) to set charging status (nessesary, it should be right after you plug in or pull out the charge line).\n"
-			 << "Notice: to avoid disturbing, this program determines "
-			 << "whether or not to make alarm sound by your manual status setting.\n\n";
-	else cout << ".\n\n";
+bool getconfig(){
+	setworkingfolder();
+	bool needconfig = ! readconfig(true);
+	if (! needconfig)
+		cout << "\n" << "you can reconfigure the program (recalculate internal resistance) by adding parameter -c.\n";
 	
-	while (cin >> str){
-		char f = tolower(str.c_str()[0]);
-		switch (f){
-			case 'e':
-				tagexit = true; break;
-			case 'c':
-				if (config.manualswitch) tagcharging = true;
-				break;
-			case 'd':
-				if (config.manualswitch) tagcharging = false;
-				break;
-			case 'l':
-				tagsavelog = ! tagsavelog;
-				cout << "Log Saving " << (tagsavelog? "Enabled" : "Disabled") << ".\n";
-		}
+	if (needconfig && daemon_mode){ //setconfig() needs a terminal
+		cout << "Error: " << working_folder << '/' << config_filename << " is missing or damaged, "
+		     << "run the program without -d to configure it.\n";
+		return false;
 	}
+	if (needconfig) return setconfig();
+	else return true;
+}
+
+// commands sent by inputloop() to checkloop() through a pipe, in order. checkloop() waits for them
+// together with its timer, so that they take effect immediately instead of at the next tick:
+// 'e' (exit), 'c'/'d' (set charging status in case of manualswitch), 'l'/'n' (enable/disable log saving),
+// 'o' (show the overhead), 'r' (reload the config file).
+class command_channel {
+	int fds[2];
+public:
+	command_channel();
+	command_channel(const command_channel&) = delete;
+	~command_channel();
 	
-	tagexit = true; // Ctrl+D pressed, input ended
+	int fd() const; //to be watched by the receiver
+	bool send(char cmd);
+	bool receive(char& cmd); //doesn't block, returns false if there's no command
+};
+
+command_channel::command_channel(){
+	if (pipe2(fds, O_CLOEXEC) != 0) {fds[0] = fds[1] = -1; return;}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
 }
 
-int main(int argc, char* argv[]){
-	// processing command parameters
-	bool reconfig = false;
-	if (argc > 1){
-		char c;
+command_channel::~command_channel(){
+	if (fds[0] >= 0) {close(fds[0]); close(fds[1]);}
+}
+
+int command_channel::fd() const{
+	return fds[0];
+}
+
+bool command_channel::send(char cmd){
+	return write(fds[1], &cmd, 1) == 1; //writes of 1 byte are atomic
+}
+
+bool command_channel::receive(char& cmd){
+	return read(fds[0], &cmd, 1) == 1;
+}
+
+command_channel commands;
+bool savelog_default = false; //-l parameter
+
+// messages about statistics and logs, printed on the console, or sent to syslog in daemon mode
+void report(const string& msg){
+	if (! daemon_mode) {cout << msg; return;}
+	size_t len = msg.length();
+	while (len > 0 && msg[len - 1] == '\n') len--;
+	if (len > 0) syslog(LOG_INFO, "%.*s", (int)len, msg.c_str());
+}
+
+// the notification protocol of systemd (see sd_notify(3)), implemented here to avoid linking libsystemd.
+// it does nothing if the program is not started by systemd with Type=notify or WatchdogSec=.
+bool sd_notify_state(const char* state){
+	const char* path = getenv("NOTIFY_SOCKET");
+	if (path == NULL || (path[0] != '/' && path[0] != '@')) return false;
+	
+	sockaddr_un addr; memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	size_t len = strlen(path);
+	if (len >= sizeof(addr.sun_path)) return false;
+	memcpy(addr.sun_path, path, len);
+	if (addr.sun_path[0] == '@') addr.sun_path[0] = '\0'; //abstract namespace
+	
+	int sfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sfd < 0) return false;
+	bool sent = sendto(sfd, state, strlen(state), MSG_NOSIGNAL,
+	                   (sockaddr*)&addr, offsetof(sockaddr_un, sun_path) + len) >= 0;
+	close(sfd);
+	return sent;
+}
+
+// period (s) of "WATCHDOG=1" pings, half of the timeout given by systemd, or 0 if the watchdog is not enabled
+double sd_watchdog_period(){
+	const char* usec = getenv("WATCHDOG_USEC"); const char* pid = getenv("WATCHDOG_PID");
+	if (usec == NULL) return 0;
+	if (pid != NULL && strtol(pid, NULL, 10) != getpid()) return 0; //it's for another process
+	return strtod(usec, NULL) / 1e6 / 2;
+}
+
+void daemon_signal_handler(int){
+	commands.send('e'); //async-signal-safe, the sessions are ended as usual
+}
+
+void reload_signal_handler(int){
+	commands.send('r'); //SIGHUP in daemon mode
+}
+
+// watches the working folder for the config file being written or replaced (saveconfig() renames a file)
+class config_watcher {
+	int ifd;
+public:
+	config_watcher();
+	config_watcher(const config_watcher&) = delete;
+	~config_watcher();
+	operator const bool() const;
+	int fd() const;
+	bool changed(); //reads the events, returns true if any is of the config file
+};
+
+config_watcher::config_watcher(){
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd >= 0 && inotify_add_watch(ifd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {close(ifd); ifd = -1;}
+}
+
+config_watcher::~config_watcher(){
+	if (ifd >= 0) close(ifd);
+}
+
+config_watcher::operator const bool() const{
+	return ifd >= 0;
+}
+
+int config_watcher::fd() const{
+	return ifd;
+}
+
+bool config_watcher::changed(){
+	alignas(inotify_event) char buf[4096]; ssize_t n; bool found = false;
+	while ((n = read(ifd, buf, sizeof(buf))) > 0)
+		for (char* p = buf; p < buf + n; p += sizeof(inotify_event) + ((inotify_event*)p)->len){
+			inotify_event* ev = (inotify_event*)p;
+			if (ev->len > 0 && config_filename == ev->name) found = true;
+		}
+	return found;
+}
+
+// runs cfg.alarmcommand by /bin/sh without waiting for it, with the battery name in $1 and the message in $2.
+// the child is reaped by the kernel, for SIGCHLD is ignored in daemon mode.
+void run_alarm_command(const string& command, const string& battery, const string& message){
+	pid_t pid = fork();
+	if (pid != 0) return; //parent, or failed
+	const char* args[] = {"sh", "-c", command.c_str(), "sh", battery.c_str(), message.c_str(), NULL};
+	execv("/bin/sh", (char* const*)args);
+	_exit(127);
+}
+
+// one condition of alarm, compiled from the config by alarm_engine
+struct alarm_rule {
+	enum quantity_t {voltage, emf, power, temperature} quantity; //power is absolute
+	enum when_t {always, discharging, charging} when; //the alarm is made only in this status
+	bool upper; //out of range while the value is greater than the limit, otherwise less than it
+	float limit, hysteresis; //the alarm is cleared after the value is back beyond the limit by hysteresis
+	const char* name;
+	
+	bool active; double pending; //monotonic time since the condition holds, -1 if it doesn't
+};
+
+// evaluates the rules for each reading in the sampling thread. a condition must hold for delay seconds
+// before its alarm becomes active, and notifications of active alarms are repeated every repeat seconds
+// (0: on every reading). the out-of-range tag of readings is still decided immediately, for statistics.
+class alarm_engine {
+	vector<alarm_rule> rules;
+	double delay, repeat; double lastnotify;
+	uint8_t activemask;
+	
+	void addrule(alarm_rule::quantity_t q, alarm_rule::when_t w, bool upper, float limit, float hysteresis, const char* name);
+	static float maxtemperature_limit(const poweralarmconfig& c);
+public:
+	alarm_engine(const poweralarmconfig& c, float designmaxvoltage);
+	void setlimits(const poweralarmconfig& c, float designmaxvoltage); //the state of the rules is kept
+	
+	// sets r.outofrange. actuald: it's actually discharging (i < 0, or by the manual setting).
+	// returns true if a notification should be made now
+	bool evaluate(power_reading& r, bool actuald);
+	uint8_t active() const; //bit i is set if rule i is active
+	string names(uint8_t mask) const; //of the rules in the mask, the names are not changed after construction
+};
+
+alarm_engine::alarm_engine(const poweralarmconfig& c, float designmaxvoltage):
+	delay(c.alarmdelay), repeat(c.alarmrepeat), lastnotify(-1), activemask(0) {
+	addrule(alarm_rule::voltage, alarm_rule::discharging, false, c.minvoltage, c.voltagehysteresis, "low voltage");
+	addrule(alarm_rule::voltage, alarm_rule::always, true, designmaxvoltage, c.voltagehysteresis, "voltage exceeds the design max");
+	addrule(alarm_rule::emf, alarm_rule::charging, true, c.maxvoltage, c.voltagehysteresis, "high voltage");
+	addrule(alarm_rule::power, alarm_rule::always, true, c.maxpower, c.powerhysteresis, "high power");
+	addrule(alarm_rule::temperature, alarm_rule::always, true, maxtemperature_limit(c), 0, "high temperature");
+}
+
+float alarm_engine::maxtemperature_limit(const poweralarmconfig& c){
+	return (c.maxtemperature > 0)? c.maxtemperature : numeric_limits<float>::infinity(); //NAN is never out of range
+}
+
+void alarm_engine::setlimits(const poweralarmconfig& c, float designmaxvoltage){
+	float limits[] = {c.minvoltage, designmaxvoltage, c.maxvoltage, c.maxpower, maxtemperature_limit(c)};
+	float hystereses[] = {c.voltagehysteresis, c.voltagehysteresis, c.voltagehysteresis, c.powerhysteresis, 0};
+	for (unsigned int i = 0; i < rules.size(); i++) {rules[i].limit = limits[i]; rules[i].hysteresis = hystereses[i];}
+	delay = c.alarmdelay; repeat = c.alarmrepeat;
+}
+
+void alarm_engine::addrule(alarm_rule::quantity_t q, alarm_rule::when_t w, bool upper, float limit, float hysteresis, const char* name){
+	alarm_rule rl;
+	rl.quantity = q; rl.when = w; rl.upper = upper; rl.limit = limit; rl.hysteresis = hysteresis; rl.name = name;
+	rl.active = false; rl.pending = -1;
+	rules.push_back(rl);
+}
+
+bool alarm_engine::evaluate(power_reading& r, bool actuald){
+	r.outofrange = false; activemask = 0;
+	for (unsigned int i = 0; i < rules.size(); i++){
+		alarm_rule& rl = rules[i];
+		float v = (rl.quantity == alarm_rule::voltage)? r.voltage : (rl.quantity == alarm_rule::emf)? r.E
+		        : (rl.quantity == alarm_rule::power)? abs(r.power()) : r.telemetry[tele_temp];
+		bool out = rl.upper? (v > rl.limit) : (v < rl.limit);
+		bool applies = (rl.when == alarm_rule::always)
+		            || (rl.when == alarm_rule::discharging && actuald)
+		            || (rl.when == alarm_rule::charging && r.charging);
+		r.outofrange = r.outofrange || out;
+		
+		if (rl.active)
+			rl.active = applies && (rl.upper? (v > rl.limit - rl.hysteresis) : (v < rl.limit + rl.hysteresis));
+		else if (out && applies){
+			if (rl.pending < 0) rl.pending = r.mtime;
+			rl.active = (r.mtime - rl.pending >= delay);
+		}
+		if (! (out && applies)) rl.pending = -1;
+		if (rl.active) activemask |= (1 << i);
+	}
+	
+	if (activemask == 0) {lastnotify = -1; return false;}
+	if (lastnotify >= 0 && r.mtime - lastnotify < repeat) return false;
+	lastnotify = r.mtime;
+	return true;
+}
+
+uint8_t alarm_engine::active() const{
+	return activemask;
+}
+
+string alarm_engine::names(uint8_t mask) const{
+	string str;
+	for (unsigned int i = 0; i < rules.size(); i++)
+		if (mask & (1 << i)) str += (str == ""? "" : ", ") + string(rules[i].name);
+	return str;
+}
+
+// estimates the internal resistance online. E hardly changes between two readings taken a few seconds apart,
+// so the changes of voltage and current satisfy dU = r * dI (reference direction of charging). r is the
+// weighted least squares solution of the pairs (dI, dU), with exponential forgetting of older pairs,
+// updated recursively in O(1) for each reading. pairs of tiny dI carry no information and are skipped.
+class ir_estimator {
+	double sxx, sxy; //weighted sums of dI^2 and dI*dU
+	float pvoltage, pcurrent; double pmtime; //previous reading, pmtime < 0 if there is none
+	
+	static constexpr double forgetting = 0.995; //per pair used, the memory is about 200 pairs
+	static constexpr double min_di = 0.05, max_dt = 30; //(A, s)
+	static constexpr double min_sxx = 0.5; //(A^2) total excitation before the estimation is used
+	static constexpr float min_ir = 0.005, max_ir = 2; //(Ω) plausible range
+public:
+	ir_estimator();
+	void add(float voltage, float current, double mtime);
+	void skip(); //the next reading isn't paired with the previous one
+	bool valid() const;
+	float value() const;
+};
+
+ir_estimator::ir_estimator(): sxx(0), sxy(0), pvoltage(0), pcurrent(0), pmtime(-1) {}
+
+void ir_estimator::add(float voltage, float current, double mtime){
+	if (pmtime >= 0 && mtime - pmtime <= max_dt){
+		double di = current - pcurrent, du = voltage - pvoltage;
+		if (abs(di) >= min_di){
+			sxx = sxx * forgetting + di * di;
+			sxy = sxy * forgetting + di * du;
+		}
+	}
+	pvoltage = voltage; pcurrent = current; pmtime = mtime;
+}
+
+void ir_estimator::skip(){
+	pmtime = -1;
+}
+
+bool ir_estimator::valid() const{
+	if (sxx < min_sxx) return false;
+	double r = sxy / sxx;
+	return (r >= min_ir && r <= max_ir);
+}
+
+float ir_estimator::value() const{
+	return sxy / sxx;
+}
+
+// latency histogram with log-linear buckets like HDR histograms: exact below 32 ns, then 16 buckets per power
+// of 2 (relative error < 6.25%) up to 2^41 ns. each histogram has only one writer, so recording is a few
+// relaxed loads and stores; it can be read by another thread at any time.
+class latency_histogram {
+	static const unsigned int sub_bits = 4, bucket_count = (41 - sub_bits + 1) << sub_bits;
+	atomic<uint64_t> buckets[bucket_count];
+	atomic<uint64_t> count, sum, max; //sum and max in ns
+	
+	static unsigned int index(uint64_t ns);
+	static uint64_t lower(unsigned int i); //the lowest value of bucket i
+public:
+	latency_histogram();
+	void record(uint64_t ns); //by the writer only
+	uint64_t size() const;
+	double mean() const; //(ns)
+	uint64_t percentile(double q) const; //upper bound of the bucket, q in [0, 1]
+	uint64_t maximum() const;
+};
+
+latency_histogram::latency_histogram(): count(0), sum(0), max(0){
+	for (unsigned int i = 0; i < bucket_count; i++) buckets[i].store(0, memory_order_relaxed);
+}
+
+unsigned int latency_histogram::index(uint64_t ns){
+	if (ns < (1ull << (sub_bits + 1))) return ns;
+	if (ns >= (1ull << 41)) ns = (1ull << 41) - 1;
+	unsigned int e = 63 - __builtin_clzll(ns);
+	return ((e - sub_bits + 1) << sub_bits) + ((ns >> (e - sub_bits)) & ((1 << sub_bits) - 1));
+}
+
+uint64_t latency_histogram::lower(unsigned int i){
+	if (i < (1u << (sub_bits + 1))) return i;
+	unsigned int e = (i >> sub_bits) + sub_bits - 1;
+	return ((1ull << sub_bits) + (i & ((1 << sub_bits) - 1))) << (e - sub_bits);
+}
+
+void latency_histogram::record(uint64_t ns){
+	atomic<uint64_t>& b = buckets[index(ns)];
+	b.store(b.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	sum.store(sum.load(memory_order_relaxed) + ns, memory_order_relaxed);
+	if (ns > max.load(memory_order_relaxed)) max.store(ns, memory_order_relaxed);
+	count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+uint64_t latency_histogram::size() const{
+	return count.load(memory_order_relaxed);
+}
+
+double latency_histogram::mean() const{
+	uint64_t n = size();
+	return (n == 0)? 0 : (double)sum.load(memory_order_relaxed) / n;
+}
+
+uint64_t latency_histogram::percentile(double q) const{
+	uint64_t n = size(), seen = 0;
+	if (n == 0) return 0;
+	uint64_t rank = (uint64_t)ceil(q * n); if (rank == 0) rank = 1;
+	for (unsigned int i = 0; i < bucket_count; i++){
+		seen += buckets[i].load(memory_order_relaxed);
+		if (seen >= rank) return min(lower(i + 1) - 1, maximum());
+	}
+	return maximum();
+}
+
+uint64_t latency_histogram::maximum() const{
+	return max.load(memory_order_relaxed);
+}
+
+// the overhead of the program itself: latencies of the stages of each reading, and samples lost.
+// read and alarm are recorded by the sampling thread, the others by the output thread: output and log for
+// each reading (the console line, the binary log), flush and logflush for each wakeup (cout, stat.log).
+// it's shown by the input 'o' and the query request "overhead".
+class overhead_monitor {
+	double startmtime, startcpu; //(s)
+	static double cputime(); //user and system time of the process
+public:
+	enum stage_t {stage_read, stage_alarm, stage_format, stage_output, stage_log, stage_flush, stage_logflush, stage_count};
+	latency_histogram stages[stage_count];
+	atomic<uint64_t> missed; //ticks the sampling thread was late for, not counting the time of suspend
+	atomic<uint64_t> dropped; //readings dropped because the queue to the output thread was full
+	atomic<uint64_t> droppedscans; //of them, readings of IIO scans, which fill the queue at high rates
+	atomic<uint64_t> samplingwakeups, outputwakeups; //returns of the waits of each thread
+	
+	overhead_monitor();
+	void start(); //at the beginning of sampling
+	string usrstr() const; //"key value" lines, stages as "stage count mean p50 p99 max" in µs
+};
+
+overhead_monitor overhead;
+
+overhead_monitor::overhead_monitor(): startmtime(0), startcpu(0), missed(0), dropped(0), droppedscans(0),
+	samplingwakeups(0), outputwakeups(0) {}
+
+double overhead_monitor::cputime(){
+	rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+void overhead_monitor::start(){
+	startmtime = monotonic_now(); startcpu = cputime();
+}
+
+string overhead_monitor::usrstr() const{
+	static const char* names[stage_count] = {"read", "alarm", "format", "output", "log", "flush", "logflush"};
+	double elapsed = monotonic_now() - startmtime, cpu = cputime() - startcpu;
+	uint64_t readings = stages[stage_read].size();
+	
+	string str = "uptime " + float_str(elapsed, 0)
+	           + "\ncpu " + float_str((elapsed > 0)? cpu / elapsed * 100 : 0, 4) //(%)
+	           + "\ncpu_per_reading " + float_str((readings > 0)? cpu / readings * 1e6 : 0, 1) //(µs)
+	           + "\nmissed " + to_string(missed.load(memory_order_relaxed))
+	           + "\ndropped " + to_string(dropped.load(memory_order_relaxed))
+	           + "\ndropped_scans " + to_string(droppedscans.load(memory_order_relaxed));
+	uint64_t swakeups = samplingwakeups.load(memory_order_relaxed), owakeups = outputwakeups.load(memory_order_relaxed);
+	str += "\nwakeups_sampling " + to_string(swakeups) + "\nwakeups_output " + to_string(owakeups)
+	     + "\nwakeups_per_minute " + float_str((elapsed > 0)? (swakeups + owakeups) * 60 / elapsed : 0, 2)
+	     + "\nreadings_per_output_wakeup " + float_str((owakeups > 0)? (double)readings / owakeups : 0, 2) + '\n';
+	for (unsigned int i = 0; i < stage_count; i++){
+		const latency_histogram& h = stages[i];
+		str += string(names[i]) + ' ' + to_string(h.size()) + ' ' + float_str(h.mean() / 1e3, 1)
+		     + ' ' + float_str(h.percentile(0.5) / 1e3, 1) + ' ' + float_str(h.percentile(0.99) / 1e3, 1)
+		     + ' ' + float_str(h.maximum() / 1e3, 1) + '\n';
+	}
+	return str;
+}
+
+// tracks how often the gauge really updates its values. many gauges refresh voltage_now and current_now only
+// every few seconds, and faster sampling gets identical readings. the period is estimated from the intervals
+// between readings with changed values, which are late by at most the sampling period.
+class gauge_cadence {
+	power_reading previous; bool has;
+	double lastchange; //mtime of the latest changed reading
+	double period; //(s) estimated, 0 if unknown
+	unsigned int changes;
+public:
+	gauge_cadence();
+	bool add(const power_reading& r); //returns true if r is a duplicate of the previous reading
+	double estimate() const; //0 until it's known
+	double last_change() const;
+};
+
+gauge_cadence::gauge_cadence(): has(false), lastchange(0), period(0), changes(0) {}
+
+bool gauge_cadence::add(const power_reading& r){
+	// a suspend or a change of status isn't a duplicate, the session may end
+	bool duplicate = has && r.voltage == previous.voltage && r.current == previous.current
+	              && r.charging == previous.charging && r.full == previous.full && r.capacity == previous.capacity
+	              && abs(r.slept - previous.slept) < 0.1;
+	if (! duplicate){
+		if (has){
+			double interval = r.mtime - lastchange;
+			if (changes >= 1 && interval > 0){ //the first interval begins at an unknown phase
+				period = (period == 0)? interval : period * 0.75 + interval * 0.25;
+			}
+			changes++;
+		}
+		lastchange = r.mtime;
+	}
+	previous = r; has = true;
+	return duplicate;
+}
+
+double gauge_cadence::estimate() const{
+	return period;
+}
+
+double gauge_cadence::last_change() const{
+	return lastchange;
+}
+
+// values of a finished session kept in the health database (see health_database), 64 B
+struct health_record {
+	int64_t begin, end; //time of the first and the last reading
+	char battery[16];
+	float fullWh, fullmAh; //full capacity estimation, 0 if the capacity changed less than 5%
+	float ir, W, Wh; //W: average power of battery (or minus power of computer circuit, see stat_summary())
+	float outofrange; //percentage of readings
+	int8_t dcapacity; uint8_t charging, manualswitch, reserved[5];
+};
+
+// ir is the resistance used for E at the end of the session, which is estimated in case of AdaptiveIR
+health_record session_health(const session_stats& stats, const poweralarmconfig& cfg, float ir, bool pcharging, const string& battery){
+	health_record h; memset(&h, 0, sizeof(h));
+	h.begin = stats.first.time; h.end = stats.last.time;
+	strncpy(h.battery, battery.c_str(), sizeof(h.battery) - 1);
+	h.ir = ir; h.W = stats.Wh*3600.0/stats.duration; h.Wh = stats.Wh;
+	h.outofrange = stats.otimes*100.0/stats.count;
+	h.charging = pcharging; h.manualswitch = cfg.manualswitch;
+	if (! cfg.manualswitch){ //percentage of battery remaining capacity is available
+		int dcapacity = stats.last.capacity - stats.first.capacity;
+		h.dcapacity = dcapacity;
+		if (dcapacity >= 5){ //changed at least 5%
+			h.fullWh = (pcharging? stats.Wh - stats.rWh : stats.Wh) * 100 / dcapacity;
+			h.fullmAh = stats.mAh * 100 / dcapacity;
+		}
+	}
+	return h;
+}
+
+// the statistic text of a finished session, written on the console and into stat.log
+string stat_summary(const session_stats& stats, const poweralarmconfig& cfg, bool pcharging, const string& label){
+	const power_reading& front = stats.first; const power_reading& back = stats.last;
+	double Wh = stats.Wh, mAh = stats.mAh, rWh = stats.rWh;
+	
+	double span = back.mtime - front.mtime; //(s)
+	int poutrange = stats.otimes*1.0/stats.count * 100;
+
+	float dE = back.E - front.E; int dcapacity;
+	if (! cfg.manualswitch) //percentage of battery remaining capacity is available
+		dcapacity = back.capacity - front.capacity;
+
+	// W is the charge power of battery, or (minus) discharge power of battery.
+	// but in case of 'manualswitch' and charging, W is (minus) power of computer circuit
+	float W = Wh*3600.0/stats.duration;
+	float rW; if (!cfg.manualswitch || !pcharging) rW = rWh*3600.0/stats.duration;
+	float CWh; if (pcharging) CWh = Wh - rWh;
+	health_record health = session_health(stats, cfg, cfg.ir, pcharging, "");
+	
+	string strstat;
+	strstat = label + (pcharging? "Charged for ":"Discharged for ") + difftime_str(span) + ", ";
+	if (! cfg.manualswitch)
+		strstat += to_string(dcapacity) + "% ("
+		         + to_string(front.capacity) + "% -> "
+		         + to_string(back.capacity) + "%), ";
+	strstat += float_str(dE, 3, true) + " V ("
+	         + float_str(front.E) + " V -> "
+	         + float_str(back.E) + " V)\n"
+	         + time_str(front.time) + " ~ " + time_str(back.time)
+	         + " (out of range in " + to_string(poutrange) + "% of time)\n";
+	if (!cfg.manualswitch || !pcharging)
+		strstat += "Average Power of Battery: " + float_str(W) + " W (Max: " + float_str(stats.maxW) + " W)    "
+		         + "Pr: " + float_str(rW) + " W\n"
+		         + "Charged: " + float_str((Wh > 0)? CWh : Wh, 3, true) + " Wh ("
+		         + float_str(mAh, 0, true) + " mAh)\n";
+	else
+		strstat += "Power of Computer Circuit: " + float_str(abs(W)) + " W\n"
+		         + "Energy cost by Computer Circuit: " + float_str(abs(Wh)) + " Wh ("
+		         + float_str(abs(mAh), 0) + " mAh)\n";
+	strstat += "Voltage: " + float_str(stats.vmean) + " V (" + float_str(stats.vmin) + " V ~ "
+	         + float_str(stats.vmax) + " V, SD: " + float_str(stats.vstddev()) + " V)\n";
+	// counters of the gauge are exact, unlike the integration of the readings
+	float dEWh = back.telemetry[tele_energy] - front.telemetry[tele_energy];
+	float dCmAh = back.telemetry[tele_charge] - front.telemetry[tele_charge];
+	if (! std::isnan(dEWh) || ! std::isnan(dCmAh))
+		strstat += "Gauge Counters:" + (std::isnan(dEWh)? "" : ' ' + float_str(dEWh, 3, true) + " Wh")
+		         + (std::isnan(dCmAh)? "" : ' ' + float_str(dCmAh, 0, true) + " mAh") + '\n';
+	if (! std::isnan(stats.tmax))
+		strstat += "Temperature: " + float_str(stats.tmin, 1) + " °C ~ " + float_str(stats.tmax, 1) + " °C\n";
+	if (! std::isnan(back.telemetry[tele_cycles]) || ! std::isnan(back.telemetry[tele_chargefull]))
+		strstat += "Gauge:" + (std::isnan(back.telemetry[tele_chargefull])? "" : " Full Charge " + float_str(back.telemetry[tele_chargefull], 0) + " mAh")
+		         + (std::isnan(back.telemetry[tele_cycles])? "" : " Cycle Count " + to_string((int)back.telemetry[tele_cycles])) + '\n';
+	if (!cfg.manualswitch && dcapacity >= 5)
+		strstat += "Full Capacity Estimation: " + float_str(health.fullWh) + " Wh ("
+		           + float_str(health.fullmAh, 0) + " mAh)\n";
+	return strstat;
+}
+
+const string health_filename = "health.db";
+
+// an append-only file of health_record following a 16 B header ("SBVAHDB", version, record size), one record
+// for each finished session. records are in the order of their end time, so that a range of dates is found
+// by binary search (see -s) without reading the whole file.
+class health_database {
+	int fd; size_t count;
+	
+	static const size_t header_size = 16;
+	static const uint32_t current_version = 1;
+public:
+	health_database();
+	health_database(const health_database&) = delete;
+	~health_database();
+	operator const bool() const;
+	
+	bool open(const string& filename, bool write); //the file is created if write is set
+	void close();
+	bool append(const health_record& h);
+	
+	size_t size() const;
+	health_record at(size_t i) const;
+	size_t lower_bound(int64_t end) const; //index of the first record which ends at end or later
+};
+
+health_database::health_database(): fd(-1), count(0) {}
+
+health_database::~health_database(){
+	close();
+}
+
+health_database::operator const bool() const{
+	return fd >= 0;
+}
+
+bool health_database::open(const string& filename, bool write){
+	close();
+	fd = ::open(filename.c_str(), (write? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) return false;
+	
+	char header[header_size] = "SBVAHDB"; uint32_t info[2] = {current_version, sizeof(health_record)};
+	struct stat st; fstat(fd, &st);
+	if (st.st_size == 0 && write){
+		memcpy(header + 8, info, sizeof(info));
+		if (pwrite(fd, header, header_size, 0) != header_size) {close(); return false;}
+		st.st_size = header_size;
+	}
+	char fheader[header_size];
+	if (pread(fd, fheader, header_size, 0) != header_size || memcmp(header, fheader, 8) != 0
+	||  memcmp(fheader + 8, info, sizeof(info)) != 0) {close(); return false;} //another version
+	count = (st.st_size - header_size) / sizeof(health_record); //an incomplete record is overwritten
+	return true;
+}
+
+void health_database::close(){
+	if (fd >= 0) ::close(fd);
+	fd = -1; count = 0;
+}
+
+bool health_database::append(const health_record& h){
+	if (fd < 0) return false;
+	if (pwrite(fd, &h, sizeof(h), header_size + count * sizeof(h)) != sizeof(h)) return false;
+	count++;
+	return true;
+}
+
+size_t health_database::size() const{
+	return count;
+}
+
+health_record health_database::at(size_t i) const{
+	health_record h; memset(&h, 0, sizeof(h));
+	pread(fd, &h, sizeof(h), header_size + i * sizeof(h));
+	return h;
+}
+
+size_t health_database::lower_bound(int64_t end) const{
+	size_t lo = 0, hi = count;
+	while (lo < hi){
+		size_t mid = (lo + hi) / 2;
+		if (at(mid).end < end) lo = mid + 1; else hi = mid;
+	}
+	return lo;
+}
+
+// mean of the full capacity estimations (Wh) of the latest 5 sessions of the battery, 0 if there's none
+float latest_full_capacity(const string& battery){
+	health_database db;
+	if (! db.open(health_filename, false)) return 0;
+	double sum = 0; unsigned int n = 0;
+	for (size_t i = db.size(); i-- > 0 && n < 5; ){
+		health_record h = db.at(i); h.battery[sizeof(h.battery) - 1] = '\0';
+		if (battery == h.battery && h.fullWh > 0) {sum += h.fullWh; n++;}
+	}
+	return n? sum / n : 0;
+}
+
+// online estimation of the time to empty (discharging) or to full (charging), O(1) per reading.
+// the power of E (E * current, without the loss on the internal resistance) and the rate of the level are
+// averaged exponentially over about 5 minutes, so that it follows the load without jumping with each reading.
+// the energy to go comes from energy_now or charge_now of the gauge, or else from the percentage and the full
+// capacity of the latest sessions (health.db); without them, the rate of the percentage is used, and without
+// the percentage (manualswitch), the rate of E towards MinVoltage or MaxVoltage.
+class runtime_predictor {
+	float fullWh; //0 if unknown
+	double W, rate; //averaged power (W) and rate of the level (per s)
+	double weight; //seconds of readings averaged, up to tau
+	float plevel; bool first;
+	
+	static constexpr double tau = 300; //(s) time constant
+	static constexpr double max_seconds = 30 * 86400; //(s) longer predictions are not given
+	static float level(const power_reading& r);
+public:
+	runtime_predictor();
+	void setfull(float wh);
+	void reset(); //a new session begins
+	void add(const power_reading& r, double dtime);
+	bool ready() const; //a minute is averaged at least
+	double seconds(const power_reading& r, float minvoltage, float maxvoltage) const; //NAN if it is unknown
+};
+
+runtime_predictor::runtime_predictor(): fullWh(0) {reset();}
+
+void runtime_predictor::setfull(float wh){
+	fullWh = wh;
+}
+
+void runtime_predictor::reset(){
+	W = rate = 0; weight = 0; plevel = 0; first = true;
+}
+
+float runtime_predictor::level(const power_reading& r){
+	return (r.capacity >= 0)? r.capacity : r.E;
+}
+
+void runtime_predictor::add(const power_reading& r, double dtime){
+	float l = level(r);
+	if (first || dtime <= 0) {if (first) W = r.E * r.current; plevel = l; first = false; return;}
+	double alpha = 1 - exp(-dtime / tau);
+	W += alpha * (r.E * r.current - W);
+	rate += alpha * ((l - plevel) / dtime - rate);
+	plevel = l; weight = min(weight + dtime, (double)tau);
+}
+
+bool runtime_predictor::ready() const{
+	return weight >= 60;
+}
+
+double runtime_predictor::seconds(const power_reading& r, float minvoltage, float maxvoltage) const{
+	if (! ready()) return NAN;
+	if (r.charging && r.full) return 0;
+	// the counters of the gauge if it provides them, then the percentage of the estimated full capacity
+	double left = NAN; //Wh
+	float charge = r.telemetry[tele_charge], chargefull = r.telemetry[tele_chargefull];
+	if (! r.charging && ! std::isnan(r.telemetry[tele_energy])) left = r.telemetry[tele_energy];
+	else if (! std::isnan(charge) && ! (r.charging && std::isnan(chargefull)))
+		left = (r.charging? chargefull - charge : charge) * r.E / 1000;
+	else if (r.capacity >= 0 && fullWh > 0) left = (r.charging? 100 - r.capacity : r.capacity) * fullWh / 100;
+	double t = NAN;
+	if (! std::isnan(left)){
+		double p = r.charging? W : -W;
+		if (p > 0.01) t = max(left, 0.0) * 3600 / p;
+	} else {
+		float target = (r.capacity >= 0)? (r.charging? 100 : 0) : (r.charging? maxvoltage : minvoltage);
+		double d = target - level(r);
+		if (r.charging? d <= 0 : d >= 0) return 0; //already reached
+		if (rate != 0 && (d < 0) == (rate < 0)) t = d / rate;
+	}
+	return (t <= max_seconds)? t : NAN; //a nearly flat trend predicts nothing
+}
+
+const size_t history_capacity = 0x40000; //readings of each battery, 4 MB
+const size_t tier10_capacity = 8640; //aggregates of 10 s, a day
+const size_t tier60_capacity = numeric_limits<uint32_t>::max() / 60000 + 1; //of 1 min, as long as a session can be
+
+// readings and statistics of one battery, with its own reader and config section.
+// sample() is called by the sampling thread, and check() is called by the output thread.
+class battery_monitor {
+	poweralarmconfig cfg;
+	power_status_reader reader;
+	alarm_engine alarms; //used by the sampling thread
+	ir_estimator irestimator; //used by the sampling thread, in case of cfg.adaptiveir
+	string label; //battery name written before each output line in case of multiple batteries
+	
+	unsigned int switch_delay;
+	
+	session_stats stats;
+	unique_ptr<reading_history> readings; //optional, for complete logs
+	unique_ptr<history_tier> tiers[2]; //10 s and 1 min aggregates, with readings. those of 1 min cover the session
+	binary_log binlog; //open while log saving is enabled, in case of cfg.binarylog
+	
+	vector<power_reading> scans; size_t nextscan = 0; bool fromscan = false; //read from the IIO buffer, used by the sampling thread
+	gauge_cadence cadence; bool duplicate = false; uint8_t palarm = 0; //used by the sampling thread
+	runtime_predictor predictor; bool lowwarned = false; //used by the output thread
+	
+	power_reading creading, preading; //current reading, previous reading
+	bool first = true; bool pcharging; //first loop, previous status
+	uint8_t alarming = 0; //active alarms of the previous reading
+	float ir = 0; //used for E of creading, see resistance_used()
+	
+	void notifyalarm(uint8_t mask, bool begin); //in daemon mode
+	void makestat();
+	void publish(const power_reading& r); //to the tiers and the binary log, once stats counts r
+	void flushheld(); //publishes and counts the held readings, at the end of a session
+	void savebinlog(const power_reading& r); //appends r or opens a new binary log
+	void closebinlog();
+public:
+	bool savelog = savelog_default; //set by the output thread
+	
+	battery_monitor(string path, const poweralarmconfig& c, bool multiple, double period);
+	operator const bool() const;
+	
+	//it should be quick, for all batteries are sampled in one pass. charging is the manual setting.
+	//alarm is the mask of active alarms (see alarm_engine), notify is set if a notification should be made
+	power_reading sample(bool charging, uint8_t& alarm, bool& notify);
+	bool pending() const; //more readings of the IIO buffer should be sampled in this tick
+	bool scanned() const; //the latest sample is of an IIO scan
+	float resistance_used() const; //ir used for E of the latest sample, for the sampling thread
+	// in case of AdaptiveInterval, the latest sample can be dropped: the same values as the previous one,
+	// and no change of alarms. the integration is the same without it.
+	bool coalesced() const;
+	const gauge_cadence& gauge() const; //for the sampling thread
+	bool attach(sysfs_ring* ring); //see power_status_reader::attach()
+	void prefetch(); //before the ring is submitted and sample() is called, unless a scan is pending
+	
+	// keys of copy_reloadable() from a reloaded config: thresholds of the alarms and ir (unless it is estimated)
+	// by the sampling thread, and the others by the output thread, when it gets to the reload in the queue
+	void reconfigure(const poweralarmconfig& c);
+	void apply(const poweralarmconfig& c);
+	void check(const power_reading& r, uint8_t alarm, bool notify, float ir, bool exiting); //integration, output and session statistics
+	
+	float resistance() const; //estimated ir, or 0 if it isn't estimated. call it after the sampling is stopped
+	
+	// for query_server, in the output thread
+	string name();
+	bool sampled() const; //false before the first reading is checked
+	const power_reading& latest() const;
+	const session_stats& statistics() const; //of the current session
+	const reading_history* history() const; //NULL if it is disabled
+	const history_tier* tier(unsigned int i) const; //0: 10 s, 1: 1 min, NULL if the history is disabled
+	double timeleft() const; //predicted seconds to empty or to full (see runtime_predictor), NAN if unknown
+};
+
+// count of readings in 10 seconds (2 in case of the default interval), see manualswitch in makestat()
+static unsigned int switch_delay_of(double period){
+	return max(2, (int)round(10 / period));
+}
+
+battery_monitor::battery_monitor(string path, const poweralarmconfig& c, bool multiple, double period):
+	cfg(c), reader(path, c.manualswitch, c.ir), alarms(c, reader.maxvoltage()), switch_delay(switch_delay_of(period)),
+	stats(c.manualswitch? switch_delay : 0) {
+	
+	label = multiple? reader.devicename() + ": " : "";
+	if (cfg.history){
+		// RawHistory limits the raw readings to the latest minutes, older ones are only in the tiers
+		size_t capacity = history_capacity;
+		if (cfg.rawhistory > 0) capacity = min(capacity, (size_t)ceil(cfg.rawhistory * 60 / period) + 1);
+		readings.reset(new reading_history(capacity, reader.telemetry()));
+		tiers[0].reset(new history_tier(10, tier10_capacity));
+		tiers[1].reset(new history_tier(60, tier60_capacity));
+	}
+	if (reader && cfg.iiodevice != "" && ! reader.usebuffer(cfg.iiodevice, cfg.iiovoltage, cfg.iiocurrent, cfg.iiotrigger))
+		report("Warning: Failed to open the IIO buffer of " + cfg.iiodevice + ", " + reader.devicename() + " is read from sysfs only.\n");
+	if (reader) predictor.setfull(latest_full_capacity(reader.devicename()));
+}
+
+battery_monitor::operator const bool() const{
+	return (bool)reader;
+}
+
+float battery_monitor::resistance() const{
+	return (cfg.adaptiveir && irestimator.valid())? irestimator.value() : 0;
+}
+
+string battery_monitor::name(){
+	return reader.devicename();
+}
+
+double battery_monitor::timeleft() const{
+	return predictor.seconds(creading, cfg.minvoltage, cfg.maxvoltage);
+}
+
+bool battery_monitor::sampled() const{
+	return creading.time != 0;
+}
+
+const power_reading& battery_monitor::latest() const{
+	return creading;
+}
+
+const session_stats& battery_monitor::statistics() const{
+	return stats;
+}
+
+const reading_history* battery_monitor::history() const{
+	return readings.get();
+}
+
+const history_tier* battery_monitor::tier(unsigned int i) const{
+	return (i < 2)? tiers[i].get() : NULL;
+}
+
+power_reading battery_monitor::sample(bool charging, uint8_t& alarm, bool& notify){
+	if (cfg.manualswitch) reader.charging = charging;
+	uint64_t t0 = monotonic_ns();
+	if (reader.buffered() && nextscan >= scans.size()) {reader.readbuffer(scans); nextscan = 0;}
+	fromscan = nextscan < scans.size();
+	power_reading r = fromscan? scans[nextscan++] : reader.read(); //sysfs if no scan arrived
+	uint64_t t1 = monotonic_ns();
+	overhead.stages[overhead_monitor::stage_read].record(t1 - t0);
+	
+	bool actuald = !r.charging || (!cfg.manualswitch && r.current < 0); //actually discharging (i < 0)
+	notify = alarms.evaluate(r, actuald);
+	
+	if (cfg.adaptiveir){
+		// in case of manualswitch and charging, the current is that of the computer circuit
+		if (cfg.manualswitch && r.charging) irestimator.skip();
+		else irestimator.add(r.voltage, r.current, r.mtime);
+		if (irestimator.valid()) reader.setresistance(irestimator.value());
+	}
+	alarm = alarms.active();
+	if (cfg.adaptiveinterval && ! reader.buffered())
+		duplicate = cadence.add(r) && ! notify && alarm == palarm;
+	palarm = alarm;
+	overhead.stages[overhead_monitor::stage_alarm].record(monotonic_ns() - t1);
+	return r;
+}
+
+void battery_monitor::reconfigure(const poweralarmconfig& c){
+	alarms.setlimits(c, reader.maxvoltage());
+	if (! (cfg.adaptiveir && irestimator.valid())) reader.setresistance(c.ir);
+}
+
+void battery_monitor::apply(const poweralarmconfig& c){
+	copy_reloadable(cfg, c);
+}
+
+bool battery_monitor::coalesced() const{
+	return duplicate;
+}
+
+const gauge_cadence& battery_monitor::gauge() const{
+	return cadence;
+}
+
+bool battery_monitor::attach(sysfs_ring* ring){
+	return reader.attach(ring);
+}
+
+void battery_monitor::prefetch(){
+	if (nextscan >= scans.size()) reader.prefetch();
+}
+
+bool battery_monitor::pending() const{
+	return nextscan < scans.size();
+}
+
+bool battery_monitor::scanned() const{
+	return fromscan;
+}
+
+float battery_monitor::resistance_used() const{
+	return reader.resistance();
+}
+
+void battery_monitor::check(const power_reading& r, uint8_t alarm, bool notify, float ir, bool exiting){
+	double dtime = 0, slept = 0; //seconds between last two readings, excluding and during suspend
+	
+	creading = r; this->ir = ir;
+	if (daemon_mode){ //the beginning and the end of alarms, repeated only if AlarmRepeat is set
+		if (alarm & ~alarming) notifyalarm(alarm & ~alarming, true);
+		else if (notify && cfg.alarmrepeat > 0) notifyalarm(alarm, true);
+		if (alarming & ~alarm) notifyalarm(alarming & ~alarm, false);
+	} else if (notify) cout << '\a'; //make alarm sound
+	alarming = alarm;
+	
+	if (! first){
+		// the previous reading is integrated over the time the system was awake, which is exact
+		// no matter how long it had been suspended, or if the sampling period changes.
+		dtime = creading.mtime - preading.mtime;
+		if (creading.slept > 0 && preading.slept > 0) slept = creading.slept - preading.slept;
+		
+		// conditions of ending the session: status changed, the system had been suspended (the power
+		// during that time is unknown), or the program will end. the history doesn't limit it,
+		// for the oldest readings are overwritten.
+		if  (   creading.charging != pcharging
+			 || slept > 0.1
+			 || exiting
+			 || (readings && ! readings->accepts(creading)))
+		{
+			stats.end(dtime);
+			if (stats.size() >= 5){ //make statistics
+				makestat();
+				if (! exiting && ! daemon_mode) cout << '\n';
+			} else {
+				flushheld(); //too few for statistics, but they are logged
+				if (! daemon_mode) cout << '\n';
+			}
+			if (slept > 0.1) report(label + "the system was suspended for " + difftime_str((time_t)slept) + ".\n");
+			
+			closebinlog();
+			if (readings) {readings->clear(); tiers[0]->clear(); tiers[1]->clear();} //memory of the history is reused
+			if (exiting) return;
+			
+			first = true; //creading begins a new session
+		}
+	}
+	if (first){
+		// in case of 'manualswitch', rWh can be calculated when discharging
+		stats.reset(!cfg.manualswitch || !creading.charging);
+		predictor.reset(); lowwarned = false;
+		first = false; dtime = 0;
+	}
+	
+	predictor.add(creading, dtime);
+	double left = timeleft();
+	if (! daemon_mode && console_output){
+		char line[160]; //the line is formatted without allocation
+		uint64_t t0 = monotonic_ns();
+		char* lineend = creading.format(line, line + sizeof(line));
+		if (! std::isnan(left)){ //before the newline
+			unsigned long minutes = (unsigned long)(left / 60); char* end = line + sizeof(line);
+			lineend = fmt_str(lineend - 1, end, ", ");
+			lineend = fmt_uint(lineend, end, minutes / 60); lineend = fmt_str(lineend, end, ":");
+			lineend = fmt_uint(lineend, end, minutes % 60, 2);
+			lineend = fmt_str(lineend, end, creading.charging? " to full\n" : " left\n");
+		}
+		uint64_t t1 = monotonic_ns();
+		cout << label; cout.write(line, lineend - line);
+		overhead.stages[overhead_monitor::stage_format].record(t1 - t0);
+		overhead.stages[overhead_monitor::stage_output].record(monotonic_ns() - t1);
+	}
+	
+	if (stats.full()) publish(stats.heldat(0)); //it's counted by add()
+	stats.add(creading, dtime);
+	if (readings) readings->push(creading);
+	
+	// an early warning: the minutes left at the current load, instead of the voltage having been crossed
+	if (cfg.lowruntime > 0 && ! creading.charging && ! lowwarned && left < cfg.lowruntime * 60){
+		lowwarned = true;
+		string text = label + "about " + difftime_str((time_t)left) + " left at the current load.";
+		if (daemon_mode){
+			syslog(LOG_WARNING, "%s", text.c_str());
+			if (cfg.alarmcommand != "") run_alarm_command(cfg.alarmcommand, reader.devicename(), text);
+		} else cout << "Warning: " << text << "\a\n";
+	}
+	
+	preading = creading; pcharging = creading.charging;
+}
+
+void battery_monitor::notifyalarm(uint8_t mask, bool begin){
+	char line[160];
+	char* lineend = creading.format(line, line + sizeof(line));
+	while (lineend > line && lineend[-1] == '\n') lineend--;
+	
+	syslog(begin? LOG_WARNING : LOG_NOTICE, "%s%s%s: %.*s", label.c_str(), alarms.names(mask).c_str(),
+	       begin? "" : " cleared", (int)(lineend - line), line);
+	if (begin && cfg.alarmcommand != "")
+		run_alarm_command(cfg.alarmcommand, reader.devicename(), string(line, lineend));
+}
+
+// the raw history has each reading at once, and makestat() retracts those it drops with pop_back(). the tiers
+// and the binary log can't retract, so they get the readings when these leave the window of stats (see
+// manualswitch), which is one reading late without manualswitch.
+void battery_monitor::publish(const power_reading& r){
+	if (tiers[0]) {tiers[0]->push(r); tiers[1]->push(r);}
+	if (cfg.binarylog){
+		uint64_t t0 = monotonic_ns();
+		savebinlog(r);
+		overhead.stages[overhead_monitor::stage_log].record(monotonic_ns() - t0);
+	}
+}
+
+void battery_monitor::flushheld(){
+	for (size_t i = 0; i < stats.heldsize(); i++) publish(stats.heldat(i));
+	stats.flush();
+}
+
+void battery_monitor::savebinlog(const power_reading& r){
+	if (! savelog) {closebinlog(); return;}
+	if (binlog) {binlog.append(r); return;}
+	
+	// log saving enabled: readings of this session in the history are written first, until r
+	power_reading first = readings? readings->front() : r;
+	string log_filename = (first.charging? "Charging_" : "Discharging_")
+	                    + (label == ""? "" : reader.devicename() + '_')
+	                    + time_str(first.time, true) + ".bin";
+	if (binlog.open(log_filename, reader.devicename(), cfg, first)){
+		if (readings)
+			for (unsigned int i = 0; i < readings->size() && (*readings)[i].mtime <= r.mtime; i++)
+				binlog.append((*readings)[i]);
+		else
+			binlog.append(r);
+	}
+}
+
+void battery_monitor::closebinlog(){
+	if (! binlog) return;
+	binlog.close();
+	report("log file " + working_folder + '/' + binlog.filename() + " saved.\n");
+}
+
+void battery_monitor::makestat(){
+	if (cfg.manualswitch && stats.heldsize() > switch_delay){
+		power_reading p15 = stats.heldat(0); //read 15 seconds before
+		for (unsigned int i = 1; i <= switch_delay; i++) // readings of last 10 seconds can be removed
+			if (abs(stats.heldat(stats.heldsize() - 1).voltage - p15.voltage) >= 0.1){
+				//such difference should be caused by manual switch delay, they are not counted
+				stats.dropback();
+				if (readings) readings->pop_back();
+			}
+	}
+	flushheld();
+	
+	string strstat = stat_summary(stats, cfg, pcharging, label);
+	
+	report('\n' + strstat + '\n');
+	
+	health_database healthdb; //only at the end of a session, so it isn't kept open
+	if (! (healthdb.open(health_filename, true) && healthdb.append(session_health(stats, cfg, ir, pcharging, name()))))
+		report("Warning: failed to write " + health_filename + ".\n");
+
+	predictor.setfull(latest_full_capacity(name())); //including this session
+	
+	if (statlog){ //written at the end of this wakeup
+		statlog.append(strstat + '\n');
+		report("appended to log file " + working_folder + '/' + stat_filename + ".\n");
+	}
+	if (savelog && ! cfg.binarylog){ //save complete log
+		if (! readings) {report("complete log can't be saved while History is disabled, try BinaryLog.\n"); return;}
+		
+		string log_filename = (pcharging? "Charging_" : "Discharging_")
+		                    + (label == ""? "" : reader.devicename() + '_')
+		                    + time_str(time(NULL),true) + ".log";
+		log_writer ofslog;
+		if (ofslog.open(log_filename, cfg, false)){
+			ofslog.append(strstat + '\n');
+			char line[160];
+			// older readings which are no longer in the history come from the tiers, coarser ones first.
+			// periods of a tier beginning before the next finer source are written, and the finer one continues
+			// after them. the last period written may overlap the beginning of the finer source.
+			double from = -numeric_limits<double>::infinity();
+			double rawbegin = (readings->size() > 0)? readings->front().mtime : numeric_limits<double>::infinity();
+			if (readings->size() < stats.count){
+				ofslog.append("(aggregates of the readings before the latest " + to_string(readings->size()) + ")\n");
+				for (unsigned int t = 2; t-- > 0; ){
+					const history_tier& tier = *tiers[t];
+					double finerbegin = (t == 1 && tiers[0]->size() > 0)? tiers[0]->begin_mtime(0) : rawbegin;
+					for (size_t i = 0; i < tier.size(); i++){
+						double begin = tier.begin_mtime(i);
+						if (begin < from - 1e-3) continue;
+						if (begin >= finerbegin) break;
+						ofslog.append(line, tier.format(line, line + sizeof(line), i) - line);
+						from = min(begin + tier.seconds(), finerbegin);
+					}
+				}
+			}
+			for (unsigned int i = 0; i < readings->size(); i++){
+				power_reading r = (*readings)[i];
+				if (r.mtime < from) continue;
+				ofslog.append(line, r.format(line, line + sizeof(line), false) - line);
+			}
+			ofslog.append("\n", 1);
+			ofslog.close();
+			report("log file " + working_folder + '/' + log_filename + " saved.\n");
+		}
+	}
+}
+
+// items passed from the sampling thread to the output thread
+struct sample_msg {
+	char command; //'\0' for a reading, 'l'/'n'/'o' forwarded from command_channel, or 'r'
+	unsigned int battery; //index of the monitor
+	uint8_t alarm; bool notify; bool exiting; //see battery_monitor::sample()
+	float ir; //used for E of the reading, see battery_monitor::resistance_used()
+	power_reading reading;
+	const poweralarmconfig* config; //with the command 'r', deleted by the output thread (battery: the monitor,
+	                                //or monitors.size() for the default section)
+};
+
+// a lock-free queue of one producer and one consumer. capacity should be a power of 2.
+template <typename T> class spsc_queue {
+	vector<T> buf; size_t mask;
+	atomic<size_t> head, tail; //next positions to pop and to push, they only increase
+public:
+	spsc_queue(size_t capacity);
+	bool push(const T& item); //by the producer, returns false if it is full
+	bool pop(T& item); //by the consumer, returns false if it is empty
+};
+
+template <typename T> spsc_queue<T>::spsc_queue(size_t capacity):
+	buf(capacity), mask(capacity - 1), head(0), tail(0) {}
+
+template <typename T> bool spsc_queue<T>::push(const T& item){
+	size_t t = tail.load(memory_order_relaxed);
+	if (t - head.load(memory_order_acquire) > mask) return false;
+	buf[t & mask] = item;
+	tail.store(t + 1, memory_order_release); //the item is visible to the consumer after this
+	return true;
+}
+
+template <typename T> bool spsc_queue<T>::pop(T& item){
+	size_t h = head.load(memory_order_relaxed);
+	if (h == tail.load(memory_order_acquire)) return false;
+	item = buf[h & mask];
+	head.store(h + 1, memory_order_release); //the slot can be reused by the producer after this
+	return true;
+}
+
+// "ADDRESS:PORT" or "[IPV6ADDRESS]:PORT" for TCP, the address may be empty if passive (any address).
+// numeric: no DNS lookup. returns NULL on failure, or the result to be freed by freeaddrinfo()
+addrinfo* resolve_address(const string& address, bool passive, bool numeric){
+	size_t colon = address.rfind(':');
+	if (colon == string::npos) return NULL;
+	string host = address.substr(0, colon), port = address.substr(colon + 1);
+	if (host.length() >= 2 && host[0] == '[' && host.back() == ']') host = host.substr(1, host.length() - 2);
+	if (host == "" && ! passive) return NULL;
+	
+	addrinfo hints; memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC; hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = (passive? AI_PASSIVE : 0) | (numeric? AI_NUMERICHOST : 0) | AI_NUMERICSERV;
+	addrinfo* ai;
+	if (getaddrinfo(host == ""? NULL : host.c_str(), port.c_str(), &hints, &ai) != 0) return NULL;
+	return ai;
+}
+
+// answers requests of other programs on a unix stream socket. it runs in the output thread (see outputloop()),
+// so the buffers of the monitors are read directly without locks. a request is a line of text:
+//   reading [BATTERY]        the latest reading
+//   stats [BATTERY]          statistics of the current session, as "key value" lines
+//   history N [BATTERY]      the latest N readings as text
+//   rawhistory N [BATTERY]   a line "BATTERY count basetime recordsize", then the latest packed_reading records
+//   aggregates S N [BATTERY] the latest N aggregates of S (10 or 60) seconds, see history_tier
+//   overhead                 see overhead_monitor::usrstr()
+// batteries are answered in order (or only the given one), and each answer ends with an empty line.
+// it can also listen on a TCP address for HTTP requests of "GET /metrics" (Prometheus text format).
+// the metrics are rendered by render() after each tick, so answering a scrape is only a write.
+class query_server {
+	struct client {
+		int fd; bool http;
+		bool closing; //eof, or it's an HTTP client answered. closed after sending
+		bool eof; //the client has shut down its side, nothing is read anymore
+		string in, out; //incomplete request, answer not sent yet
+	};
+	int listenfd, httpfd, epfd, wakefd;
+	map<int, client> clients;
+	string path; //unlinked at the end, empty if the socket is passed by systemd
+	
+	// double buffered metrics: render() writes the one not being served, then they are swapped.
+	// the header is rendered together, for it has the length of the text.
+	vector<char> metrics[2]; size_t metricslen[2]; char metricshead[2][128]; size_t metricsheadlen[2];
+	int curmetrics;
+	
+	static const size_t max_clients = 64, max_pending = 0x1000000; //16 MB
+	
+	void acceptclients(int lfd);
+	bool receive(client& c, vector<unique_ptr<battery_monitor>>& monitors); //returns false if c should be closed
+	void answer(client& c, const string& request, vector<unique_ptr<battery_monitor>>& monitors);
+	void answerhttp(client& c);
+	bool send(client& c, iovec* iov, int n); //what can't be sent now is copied into c.out
+	bool flush(client& c);
+	void setwritable(client& c, bool waiting);
+	void drop(int fd);
+	void add(int fd);
+public:
+	query_server(int wfd); //wfd is the eventfd of outputloop()
+	query_server(const query_server&) = delete;
+	~query_server();
+	operator const bool() const; //listening on any socket
+	
+	bool listenunix(const string& socketpath); //or the socket passed by systemd
+	bool listenhttp(const string& address); //"ADDRESS:PORT", or "[IPV6ADDRESS]:PORT"
+	void render(vector<unique_ptr<battery_monitor>>& monitors); //metrics of the latest readings
+	void wait(vector<unique_ptr<battery_monitor>>& monitors); //serves the clients until wakefd is readable
+};
+
+query_server::query_server(int wfd): listenfd(-1), httpfd(-1), wakefd(wfd), curmetrics(0){
+	metricslen[0] = metricslen[1] = metricsheadlen[0] = metricsheadlen[1] = 0;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd >= 0) add(wakefd);
+}
+
+query_server::~query_server(){
+	for (map<int, client>::iterator it = clients.begin(); it != clients.end(); it++)
+		close(it->first);
+	if (epfd >= 0) close(epfd);
+	if (listenfd >= 0) close(listenfd);
+	if (httpfd >= 0) close(httpfd);
+	if (path != "") unlink(path.c_str());
+}
+
+query_server::operator const bool() const{
+	return (epfd >= 0 && (listenfd >= 0 || httpfd >= 0));
+}
+
+void query_server::add(int fd){
+	epoll_event ev; memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN; ev.data.fd = fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+bool query_server::listenunix(const string& socketpath){
+	if (epfd < 0) return false;
+	// socket activation (see sd_listen_fds(3)): the listening socket is passed by systemd as fd 3
+	const char* fds = getenv("LISTEN_FDS"); const char* pid = getenv("LISTEN_PID");
+	if (fds != NULL && pid != NULL && strtol(pid, NULL, 10) == getpid() && strtol(fds, NULL, 10) >= 1){
+		listenfd = 3;
+		fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+		fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+	} else {
+		sockaddr_un addr; memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (socketpath == "" || socketpath.length() >= sizeof(addr.sun_path)) return false;
+		memcpy(addr.sun_path, socketpath.c_str(), socketpath.length());
+		
+		listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+		if (listenfd < 0) return false;
+		unlink(socketpath.c_str()); //left by the previous run
+		if (bind(listenfd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenfd, 16) != 0){
+			close(listenfd); listenfd = -1; return false;
+		}
+		path = socketpath;
+	}
+	add(listenfd);
+	return true;
+}
+
+bool query_server::listenhttp(const string& address){
+	if (epfd < 0) return false;
+	addrinfo* ai = resolve_address(address, true, true);
+	if (ai == NULL) return false;
+	
+	httpfd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	int on = 1;
+	if (httpfd >= 0) setsockopt(httpfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (httpfd >= 0 && (bind(httpfd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(httpfd, 16) != 0)){
+		close(httpfd); httpfd = -1;
+	}
+	freeaddrinfo(ai);
+	if (httpfd < 0) return false;
+	add(httpfd);
+	return true;
+}
+
+void query_server::wait(vector<unique_ptr<battery_monitor>>& monitors){
+	epoll_event evs[16]; uint64_t cnt;
+	bool woken = false;
+	while (! woken){
+		int n = epoll_wait(epfd, evs, 16, -1);
+		if (n < 0 && errno != EINTR) return;
+		
+		for (int i = 0; i < n; i++){
+			int fd = evs[i].data.fd;
+			if (fd == wakefd){
+				read(wakefd, &cnt, sizeof(cnt));
+				woken = true;
+			} else if (fd == listenfd || fd == httpfd)
+				acceptclients(fd);
+			else {
+				map<int, client>::iterator it = clients.find(fd);
+				if (it == clients.end()) continue;
+				bool keep = true;
+				if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) keep = receive(it->second, monitors);
+				if (keep && (evs[i].events & EPOLLOUT)) keep = flush(it->second);
+				if (! keep) drop(fd);
+			}
+		}
+	}
+}
+
+void query_server::acceptclients(int lfd){
+	int fd;
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+		if (clients.size() >= max_clients) {close(fd); continue;}
+		epoll_event ev; memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN; ev.data.fd = fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {close(fd); continue;}
+		client& c = clients[fd];
+		c.fd = fd; c.http = (lfd == httpfd); c.closing = c.eof = false;
+	}
+}
+
+bool query_server::receive(client& c, vector<unique_ptr<battery_monitor>>& monitors){
+	char buf[512]; ssize_t r;
+	while (! c.eof){ //input of an answered HTTP client is read and discarded, or EPOLLIN would stay ready
+		r = recv(c.fd, buf, sizeof(buf), 0);
+		if (r > 0) {if (! c.closing) c.in.append(buf, r);}
+		else if (r == 0) {c.eof = c.closing = true; if (! c.out.empty()) setwritable(c, true);}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+		else if (errno != EINTR) return false;
+	}
+	
+	size_t pos;
+	if (c.http){ //one request per connection, the body is ignored
+		if (c.in.find("\r\n\r\n") != string::npos || c.in.find("\n\n") != string::npos) answerhttp(c);
+		if (c.in.length() > 2048) return false;
+		return ! (c.closing && c.out.empty());
+	}
+	while ((pos = c.in.find('\n')) != string::npos){
+		string request = c.in.substr(0, pos);
+		c.in.erase(0, pos + 1);
+		answer(c, request, monitors);
+	}
+	if (c.in.length() > sizeof(buf)) return false; //it's not a request
+	if (c.out.length() > max_pending) return false; //the client doesn't read the answers
+	return ! (c.closing && c.out.empty());
+}
+
+void query_server::answer(client& c, const string& request, vector<unique_ptr<battery_monitor>>& monitors){
+	istringstream iss(request);
+	string cmd, battery; size_t n = 0; unsigned int seconds = 0;
+	iss >> cmd;
+	if (cmd == "aggregates") iss >> seconds;
+	if (cmd == "history" || cmd == "rawhistory" || cmd == "aggregates") iss >> n;
+	iss >> battery;
+	
+	string text; iovec iov[3];
+	if (cmd == "overhead")
+		text = overhead.usrstr();
+	else if (cmd != "reading" && cmd != "stats" && cmd != "history" && cmd != "rawhistory" && cmd != "aggregates")
+		text = "error: unknown request\n";
+	else if (cmd == "aggregates" && seconds != 10 && seconds != 60)
+		text = "error: aggregates of 10 or 60 seconds\n";
+	else for (unsigned int i = 0; i < monitors.size(); i++){
+		battery_monitor& m = *monitors[i];
+		string name = m.name();
+		if ((battery != "" && name != battery) || ! m.sampled()) continue;
+		
+		if (cmd == "reading"){
+			char line[160];
+			text += name + ' ';
+			text.append(line, m.latest().format(line, line + sizeof(line)));
+		} else if (cmd == "stats"){
+			const session_stats& st = m.statistics();
+			text += "battery " + name + "\ncharging " + (m.latest().charging? "1" : "0")
+			      + "\nreadings " + to_string(st.count) + "\nduration " + float_str(st.duration)
+			      + "\nWh " + float_str(st.Wh) + "\nmAh " + float_str(st.mAh) + "\nrWh " + float_str(st.rWh)
+			      + "\nmaxW " + float_str(st.maxW) + "\noutofrange " + to_string(st.otimes)
+			      + "\nvmean " + float_str(st.vmean) + "\nvmin " + float_str(st.vmin)
+			      + "\nvmax " + float_str(st.vmax) + "\nvsd " + float_str(st.vstddev())
+			      + (m.latest().charging? "\ntimetofull " : "\ntimetoempty ") + float_str(m.timeleft(), 0) + '\n';
+			for (unsigned int k = 0; k < tele_count; k++) //of the latest reading, those provided by the device
+				if (! std::isnan(m.latest().telemetry[k]))
+					text += string(telemetry_descs[k].name) + ' ' + float_str(m.latest().telemetry[k]) + '\n';
+		} else if (cmd == "aggregates"){
+			const history_tier* t = m.tier(seconds == 10? 0 : 1);
+			if (t == NULL) continue;
+			char line[160];
+			for (size_t j = t->size() - min(n, t->size()); j < t->size(); j++){
+				text += name + ' ';
+				text.append(line, t->format(line, line + sizeof(line), j));
+			}
+		} else {
+			const reading_history* h = m.history();
+			if (h == NULL) continue;
+			const packed_reading* a; const packed_reading* b; size_t na, nb;
+			size_t count = h->latest(n, a, na, b, nb);
+			if (cmd == "history"){
+				for (size_t j = h->size() - count; j < h->size(); j++)
+					text += name + ' ' + (*h)[j].usrstr();
+				continue;
+			}
+			// the records are sent from the ring directly
+			text += name + ' ' + to_string(count) + ' ' + to_string((long long)h->base_time())
+			      + ' ' + to_string(sizeof(packed_reading)) + '\n';
+			iov[0].iov_base = (void*)text.data(); iov[0].iov_len = text.length();
+			iov[1].iov_base = (void*)a; iov[1].iov_len = na * sizeof(packed_reading);
+			iov[2].iov_base = (void*)b; iov[2].iov_len = nb * sizeof(packed_reading);
+			send(c, iov, 3);
+			text.clear();
+		}
+	}
+	
+	text += '\n';
+	iov[0].iov_base = (void*)text.data(); iov[0].iov_len = text.length();
+	send(c, iov, 1);
+}
+
+void query_server::answerhttp(client& c){
+	static const char notfound[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	static const char unavailable[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	iovec iov[2];
+	if (c.in.compare(0, 13, "GET /metrics ") != 0 && c.in.compare(0, 13, "GET /metrics?") != 0){
+		iov[0].iov_base = (void*)notfound; iov[0].iov_len = sizeof(notfound) - 1;
+		send(c, iov, 1);
+	} else if (metricsheadlen[curmetrics] == 0){ //nothing is sampled yet
+		iov[0].iov_base = (void*)unavailable; iov[0].iov_len = sizeof(unavailable) - 1;
+		send(c, iov, 1);
+	} else {
+		iov[0].iov_base = metricshead[curmetrics]; iov[0].iov_len = metricsheadlen[curmetrics];
+		iov[1].iov_base = metrics[curmetrics].data(); iov[1].iov_len = metricslen[curmetrics];
+		send(c, iov, 2);
+	}
+	c.in.clear(); c.closing = true;
+}
+
+// metrics exported for each battery, the value is NAN if it is unknown
+struct metric_desc {
+	const char* name; const char* type; const char* help;
+	double (*value)(battery_monitor& m);
+};
+
+static const metric_desc metric_descs[] = {
+	{"battery_voltage_volts", "gauge", "Voltage of the latest reading.",
+		[](battery_monitor& m) -> double {return m.latest().voltage;}},
+	{"battery_emf_volts", "gauge", "Estimated electromotive force (E) of the latest reading.",
+		[](battery_monitor& m) -> double {return m.latest().E;}},
+	{"battery_current_amperes", "gauge", "Current of the latest reading, positive while charging.",
+		[](battery_monitor& m) -> double {return m.latest().current;}},
+	{"battery_power_watts", "gauge", "Power of the latest reading, positive while charging.",
+		[](battery_monitor& m) -> double {return m.latest().voltage * m.latest().current;}},
+	{"battery_capacity_percent", "gauge", "Remaining capacity of the latest reading.",
+		[](battery_monitor& m) -> double {return (m.latest().capacity >= 0)? m.latest().capacity : NAN;}},
+	{"battery_charging", "gauge", "1 if it is charging.",
+		[](battery_monitor& m) -> double {return m.latest().charging;}},
+	{"battery_out_of_range", "gauge", "1 if the latest reading is out of the proper range.",
+		[](battery_monitor& m) -> double {return m.latest().outofrange;}},
+	{"battery_time_left_seconds", "gauge", "Predicted time to empty while discharging, or to full while charging.",
+		[](battery_monitor& m) -> double {return m.timeleft();}},
+	{"battery_session_energy_wh", "gauge", "Energy charged in the current session, negative while discharging.",
+		[](battery_monitor& m) -> double {return m.statistics().Wh;}},
+	{"battery_session_charge_mah", "gauge", "Charge of the current session, negative while discharging.",
+		[](battery_monitor& m) -> double {return m.statistics().mAh;}},
+	{"battery_session_resistance_loss_wh", "gauge", "Energy wasted on the internal resistance in the current session.",
+		[](battery_monitor& m) -> double {return m.statistics().rWh;}},
+	{"battery_session_max_power_watts", "gauge", "Power of the largest absolute value in the current session.",
+		[](battery_monitor& m) -> double {return m.statistics().maxW;}},
+	{"battery_session_out_of_range_readings", "gauge", "Count of out-of-range readings in the current session.",
+		[](battery_monitor& m) -> double {return m.statistics().otimes;}},
+	{"battery_session_readings", "gauge", "Count of readings in the current session.",
+		[](battery_monitor& m) -> double {return m.statistics().count;}},
+	{"battery_session_duration_seconds", "gauge", "Duration of the current session, excluding suspend.",
+		[](battery_monitor& m) -> double {return m.statistics().duration;}},
+	{"battery_session_capacity_delta_percent", "gauge", "Change of the remaining capacity in the current session.",
+		[](battery_monitor& m) -> double {
+			const session_stats& st = m.statistics();
+			return (st.count > 0 && st.first.capacity >= 0)? st.last.capacity - st.first.capacity : NAN;}}
+};
+
+void query_server::render(vector<unique_ptr<battery_monitor>>& monitors){
+	if (httpfd < 0) return;
+	int next = 1 - curmetrics; //not being served
+	vector<char>& buf = metrics[next];
+	if (buf.empty()) buf.resize(0x1000 + monitors.size() * 0x800);
+	
+	vector<string> names;
+	for (unsigned int i = 0; i < monitors.size(); i++) names.push_back(monitors[i]->name());
+	
+	char* p; char* end;
+	while (true){ //rendered again into a larger buffer if it is truncated
+		p = buf.data(); end = p + buf.size();
+		for (unsigned int d = 0; d < sizeof(metric_descs) / sizeof(metric_desc); d++){
+			const metric_desc& md = metric_descs[d];
+			p = fmt_str(p, end, "# HELP "); p = fmt_str(p, end, md.name); p = fmt_str(p, end, " ");
+			p = fmt_str(p, end, md.help); p = fmt_str(p, end, "\n# TYPE "); p = fmt_str(p, end, md.name);
+			p = fmt_str(p, end, " "); p = fmt_str(p, end, md.type); p = fmt_str(p, end, "\n");
+			for (unsigned int i = 0; i < monitors.size(); i++){
+				if (! monitors[i]->sampled()) continue;
+				double v = md.value(*monitors[i]);
+				if (std::isnan(v)) continue;
+				p = fmt_str(p, end, md.name); p = fmt_str(p, end, "{battery=\"");
+				p = fmt_str(p, end, names[i].c_str()); p = fmt_str(p, end, "\"} ");
+				p = fmt_float(p, end, v); p = fmt_str(p, end, "\n");
+			}
+		}
+		for (unsigned int k = 0; k < tele_count; k++){ //the telemetry of the batteries providing it
+			const telemetry_desc& td = telemetry_descs[k];
+			p = fmt_str(p, end, "# HELP "); p = fmt_str(p, end, td.metric); p = fmt_str(p, end, " Attribute ");
+			p = fmt_str(p, end, td.file); p = fmt_str(p, end, " of the latest reading.\n# TYPE ");
+			p = fmt_str(p, end, td.metric); p = fmt_str(p, end, " gauge\n");
+			for (unsigned int i = 0; i < monitors.size(); i++){
+				if (! monitors[i]->sampled() || std::isnan(monitors[i]->latest().telemetry[k])) continue;
+				p = fmt_str(p, end, td.metric); p = fmt_str(p, end, "{battery=\"");
+				p = fmt_str(p, end, names[i].c_str()); p = fmt_str(p, end, "\"} ");
+				p = fmt_float(p, end, monitors[i]->latest().telemetry[k]); p = fmt_str(p, end, "\n");
+			}
+		}
+		if (p < end) break;
+		buf.resize(buf.size() * 2);
+	}
+	metricslen[next] = p - buf.data();
+	
+	p = metricshead[next]; end = p + sizeof(metricshead[next]);
+	p = fmt_str(p, end, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ");
+	p = fmt_uint(p, end, metricslen[next]);
+	p = fmt_str(p, end, "\r\nConnection: close\r\n\r\n");
+	metricsheadlen[next] = p - metricshead[next];
+	
+	curmetrics = next;
+}
+
+bool query_server::send(client& c, iovec* iov, int n){
+	size_t sent = 0;
+	if (c.out.empty()){ //nothing is waiting before it
+		msghdr msg; memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov; msg.msg_iovlen = n;
+		ssize_t r;
+		do r = sendmsg(c.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		while (r < 0 && errno == EINTR);
+		if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return false;
+		if (r > 0) sent = r;
+	}
+	
+	for (int i = 0; i < n; i++){
+		if (sent >= iov[i].iov_len) {sent -= iov[i].iov_len; continue;}
+		c.out.append((const char*)iov[i].iov_base + sent, iov[i].iov_len - sent);
+		sent = 0;
+	}
+	if (! c.out.empty()) setwritable(c, true);
+	return true;
+}
+
+bool query_server::flush(client& c){
+	while (! c.out.empty()){
+		ssize_t r = ::send(c.fd, c.out.data(), c.out.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (r > 0) c.out.erase(0, r);
+		else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+		else if (r < 0 && errno != EINTR) return false;
+	}
+	setwritable(c, false);
+	return ! c.closing;
+}
+
+void query_server::setwritable(client& c, bool waiting){
+	epoll_event ev; memset(&ev, 0, sizeof(ev));
+	ev.events = (c.eof? 0u : (uint32_t)EPOLLIN) | (waiting? (uint32_t)EPOLLOUT : 0u); ev.data.fd = c.fd;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+void query_server::drop(int fd){
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+	clients.erase(fd);
+}
+
+// fleet mode: the readings of many instances are streamed to a collector (-C ADDRESS:PORT) over TCP.
+// a connection begins with the line "SBVAFLEET 1 HOSTNAME\n", followed by frames of a varint length and
+// a payload, which is 'B' varint id, battery name (declares a battery of the sender), 'R' varint id,
+// varint count, records, or 'E' varint id, record (the reading at the end of the program, which ends the
+// session as in battery_monitor::check() without being counted). each record is the difference to the
+// previous record of the battery in the connection, as zigzag varints (see fleet_codec). slowly changing
+// readings take about 10 B instead of 48 B.
+static void put_varint(string& out, uint64_t x){
+	while (x >= 0x80) {out += (char)(x | 0x80); x >>= 7;}
+	out += (char)x;
+}
+
+static bool get_varint(const char*& p, const char* end, uint64_t& x){
+	x = 0;
+	for (unsigned int shift = 0; shift < 64 && p < end; shift += 7){
+		uint8_t b = *p++;
+		x |= (uint64_t)(b & 0x7f) << shift;
+		if (! (b & 0x80)) return true;
+	}
+	return false;
+}
+
+struct fleet_codec {
+	// flags, ms of mtime, s of time, µV, µA, 100 µV of E - voltage, %, ms of slept
+	enum {n_fields = 8};
+	int64_t prev[n_fields]; //of the previous record, 0 at the beginning of a connection
+	
+	fleet_codec();
+	void encode(const power_reading& r, string& out);
+	bool decode(const char*& p, const char* end, power_reading& r); //false if the record is incomplete
+};
+
+fleet_codec::fleet_codec(){
+	for (unsigned int i = 0; i < n_fields; i++) prev[i] = 0;
+}
+
+void fleet_codec::encode(const power_reading& r, string& out){
+	int64_t v[n_fields] = {
+		(r.charging? packed_reading::flag_charging : 0) | (r.full? packed_reading::flag_full : 0)
+			| (r.outofrange? packed_reading::flag_outofrange : 0),
+		llround(r.mtime * 1000), (int64_t)r.time, lround(r.voltage * 1e6), lround(r.current * 1e6),
+		max(-32768L, min(32767L, lround((r.E - r.voltage) * 1e4))), r.capacity, llround(r.slept * 1000)
+	};
+	for (unsigned int i = 0; i < n_fields; i++){
+		uint64_t d = (uint64_t)(v[i] - prev[i]);
+		put_varint(out, (d << 1) ^ (uint64_t)((int64_t)d >> 63)); //zigzag
+		prev[i] = v[i];
+	}
+}
+
+bool fleet_codec::decode(const char*& p, const char* end, power_reading& r){
+	int64_t v[n_fields]; uint64_t z;
+	for (unsigned int i = 0; i < n_fields; i++){
+		if (! get_varint(p, end, z)) return false;
+		v[i] = prev[i] + (int64_t)((z >> 1) ^ -(z & 1));
+	}
+	for (unsigned int i = 0; i < n_fields; i++) prev[i] = v[i];
+	
+	float voltage = v[3] / 1e6f;
+	r = power_reading((time_t)v[2], v[1] / 1000.0, v[0] & packed_reading::flag_charging, v[0] & packed_reading::flag_full,
+	                  voltage, v[4] / 1e6f, (v[5] == 0)? voltage : voltage + v[5] / 1e4f, (int)v[6]);
+	r.outofrange = v[0] & packed_reading::flag_outofrange;
+	r.slept = v[7] / 1000.0;
+	return true;
+}
+
+// sends the readings to the collector in batches, in the output thread. the socket is non-blocking, readings
+// are kept while it's disconnected (the oldest ones are dropped), and it's reconnected every retry_interval.
+// frames encoded but not sent are lost if the connection breaks.
+class fleet_sender {
+	string address, hostname;
+	vector<string> names; //of the batteries, ids are the indexes
+	unsigned int batch; //readings of a battery per frame
+	int fd; bool connected; bool failed; //failed: the failure is reported once
+	double retrymtime;
+	vector<deque<power_reading>> pending; //not encoded yet
+	vector<power_reading> endings; vector<bool> ended; //the last readings, see add()
+	vector<fleet_codec> codecs;
+	string out; //encoded, not sent yet
+	
+	static const size_t max_pending = 0x10000; //readings of each battery
+	static const size_t max_out = 0x100000; //1 MB, no more frames are encoded before it's sent
+	static constexpr double retry_interval = 10; //(s)
+	
+	void connectnow();
+	void disconnect();
+	bool writeout(); //returns false on errors
+public:
+	fleet_sender(const string& collector, const vector<string>& batterynames, unsigned int batchsize);
+	fleet_sender(const fleet_sender&) = delete;
+	~fleet_sender();
+	
+	void add(unsigned int battery, const power_reading& r, bool exiting); //nothing is added after exiting
+	void flush(bool all); //sends full batches, or everything pending if all is set
+	void finish(); //sends everything, waiting for at most 2 s
+};
+
+fleet_sender::fleet_sender(const string& collector, const vector<string>& batterynames, unsigned int batchsize):
+	address(collector), names(batterynames), batch(max(1u, batchsize)), fd(-1), connected(false), failed(false),
+	retrymtime(0), pending(batterynames.size()), endings(batterynames.size()), ended(batterynames.size(), false)
+{
+	char buf[256];
+	hostname = (gethostname(buf, sizeof(buf)) == 0)? string(buf, strnlen(buf, sizeof(buf))) : "unknown";
+}
+
+fleet_sender::~fleet_sender(){
+	disconnect();
+}
+
+void fleet_sender::connectnow(){
+	retrymtime = monotonic_now() + retry_interval;
+	addrinfo* ai = resolve_address(address, false, false);
+	if (ai == NULL) {if (! failed) report("Warning: Failed to resolve the collector " + address + ".\n"); failed = true; return;}
+	fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS) {close(fd); fd = -1;}
+	freeaddrinfo(ai);
+}
+
+void fleet_sender::disconnect(){
+	if (fd < 0) return;
+	close(fd); fd = -1;
+	if (connected) report("disconnected from the collector " + address + ".\n");
+	connected = false; out.clear();
+}
+
+bool fleet_sender::writeout(){
+	while (! out.empty()){
+		ssize_t r = ::send(fd, out.data(), out.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (r > 0) out.erase(0, r);
+		else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+		else if (r < 0 && errno == EINTR) continue;
+		else return false;
+	}
+	return true;
+}
+
+void fleet_sender::add(unsigned int battery, const power_reading& r, bool exiting){
+	if (exiting) {endings[battery] = r; ended[battery] = true; return;}
+	deque<power_reading>& q = pending[battery];
+	q.push_back(r);
+	if (q.size() > max_pending) q.pop_front();
+}
+
+void fleet_sender::flush(bool all){
+	if (fd < 0 && monotonic_now() >= retrymtime) connectnow();
+	if (fd < 0) return;
+	
+	if (! connected){ //the connection is in progress
+		pollfd pfd = {fd, POLLOUT, 0}; int err = 0; socklen_t len = sizeof(err);
+		if (poll(&pfd, 1, 0) <= 0) return;
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0){
+			if (! failed) report("Warning: Failed to connect to the collector " + address + ".\n");
+			failed = true; disconnect(); return;
+		}
+		connected = true; failed = false;
+		report("connected to the collector " + address + ".\n");
+		
+		// the state of the codecs begins again in each connection
+		codecs.assign(names.size(), fleet_codec());
+		out = "SBVAFLEET 1 " + hostname + '\n';
+		for (unsigned int i = 0; i < names.size(); i++){
+			string frame = "B"; put_varint(frame, i); frame += names[i];
+			put_varint(out, frame.length()); out += frame;
+		}
+	}
+	
+	string frame;
+	for (unsigned int i = 0; i < pending.size() && out.length() < max_out; i++){
+		deque<power_reading>& q = pending[i];
+		if (q.empty() || (! all && q.size() < batch)) continue;
+		while (! q.empty() && out.length() < max_out){
+			size_t n = min<size_t>(q.size(), batch);
+			frame = "R"; put_varint(frame, i); put_varint(frame, n);
+			for (size_t j = 0; j < n; j++) codecs[i].encode(q[j], frame);
+			q.erase(q.begin(), q.begin() + n);
+			put_varint(out, frame.length()); out += frame;
+			if (! all && q.size() < batch) break;
+		}
+	}
+	for (unsigned int i = 0; i < pending.size() && all && out.length() < max_out; i++){
+		if (! ended[i] || ! pending[i].empty()) continue;
+		frame = "E"; put_varint(frame, i); codecs[i].encode(endings[i], frame);
+		put_varint(out, frame.length()); out += frame;
+		ended[i] = false;
+	}
+	if (! writeout()) disconnect();
+}
+
+void fleet_sender::finish(){
+	double deadline = monotonic_now() + 2;
+	while (true){
+		flush(true);
+		bool empty = out.empty();
+		for (unsigned int i = 0; i < pending.size(); i++) empty = empty && pending[i].empty() && ! ended[i];
+		if (empty || fd < 0 || monotonic_now() >= deadline) break;
+		pollfd pfd = {fd, POLLOUT, 0};
+		poll(&pfd, 1, 100);
+	}
+}
+
+// collector mode (-C ADDRESS:PORT): receives the readings of fleet_senders in an epoll loop, and keeps a ring
+// history and session statistics for each battery of each host. the statistics of finished sessions are
+// printed and appended to fleet.log. it stops on SIGINT or SIGTERM.
+class fleet_collector {
+	struct device {
+		string label; //"HOST/BATTERY: "
+		reading_history readings;
+		session_stats stats;
+		power_reading preading; bool first;
+		device(const string& l): label(l), readings(max_history), first(true) {}
+	};
+	struct client {
+		string host; bool hello = false;
+		string in; //incomplete frame
+		vector<device*> devices; vector<fleet_codec> codecs; //by the ids of the sender
+	};
+	int listenfd, epfd;
+	map<int, client> clients;
+	map<string, unique_ptr<device>> devices; //by "HOST/BATTERY"
+	log_writer statlog;
+	
+	static const size_t max_history = 0x4000; //readings of each device, 256 KB
+	static const size_t max_frame = 0x100000;
+	static constexpr double max_gap = 300; //(s) a session ends if no reading is received in this time
+	
+	bool receive(int fd, client& c); //returns false if the client should be dropped
+	bool frame(client& c, const char* p, const char* end);
+	void check(device& d, const power_reading& r);
+	void endsession(device& d, double dtime);
+	void drop(int fd);
+public:
+	fleet_collector();
+	fleet_collector(const fleet_collector&) = delete;
+	~fleet_collector();
+	bool listenon(const string& address);
+	void run(); //until 'e' is received from command_channel
+};
+
+fleet_collector::fleet_collector(): listenfd(-1){
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+fleet_collector::~fleet_collector(){
+	for (map<int, client>::iterator it = clients.begin(); it != clients.end(); ++it) close(it->first);
+	if (listenfd >= 0) close(listenfd);
+	if (epfd >= 0) close(epfd);
+}
+
+bool fleet_collector::listenon(const string& address){
+	if (epfd < 0) return false;
+	addrinfo* ai = resolve_address(address, true, true);
+	if (ai == NULL) return false;
+	listenfd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	int on = 1;
+	if (listenfd >= 0) setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (listenfd >= 0 && (bind(listenfd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(listenfd, 512) != 0)){
+		close(listenfd); listenfd = -1;
+	}
+	freeaddrinfo(ai);
+	if (listenfd < 0) return false;
+	
+	epoll_event ev; memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN; ev.data.fd = listenfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+	ev.data.fd = commands.fd();
+	epoll_ctl(epfd, EPOLL_CTL_ADD, commands.fd(), &ev);
+	return true;
+}
+
+void fleet_collector::run(){
+	if (! statlog.open("fleet.log", config, true))
+		cout << "Warning: Failed to open " << working_folder << "/fleet.log.\n";
+	epoll_event evs[64]; char cmd;
+	bool exiting = false;
+	while (! exiting){
+		int n = epoll_wait(epfd, evs, 64, -1);
+		if (n < 0 && errno != EINTR) break;
+		for (int i = 0; i < n; i++){
+			int fd = evs[i].data.fd;
+			if (fd == commands.fd()){
+				while (commands.receive(cmd)) if (cmd == 'e') exiting = true;
+			} else if (fd == listenfd){
+				int cfd;
+				while ((cfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+					epoll_event ev; memset(&ev, 0, sizeof(ev));
+					ev.events = EPOLLIN; ev.data.fd = cfd;
+					if (epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev) != 0) {close(cfd); continue;}
+					clients[cfd];
+				}
+			} else {
+				map<int, client>::iterator it = clients.find(fd);
+				if (it != clients.end() && ! receive(fd, it->second)) drop(fd);
+			}
+		}
+		cout.flush(); statlog.flush();
+	}
+	
+	for (map<string, unique_ptr<device>>::iterator it = devices.begin(); it != devices.end(); ++it)
+		if (! it->second->first) endsession(*it->second, 0);
+	cout.flush(); statlog.close();
+}
+
+bool fleet_collector::receive(int fd, client& c){
+	char buf[0x10000]; ssize_t r;
+	bool eof = false; //what is received before is still processed
+	while (! eof){
+		r = recv(fd, buf, sizeof(buf), 0);
+		if (r == 0) {eof = true; break;}
+		if (r < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			return false;
+		}
+		c.in.append(buf, r);
+	}
+	
+	const char* p = c.in.data(); const char* end = p + c.in.length();
+	if (! c.hello){
+		const char* nl = (const char*)memchr(p, '\n', end - p);
+		if (nl == NULL) return ! eof && c.in.length() <= 256;
+		string line(p, nl);
+		if (line.compare(0, 12, "SBVAFLEET 1 ") != 0 || line.length() == 12) return false;
+		c.host = line.substr(12); c.hello = true;
+		report(c.host + " connected.\n");
+		p = nl + 1;
+	}
+	while (p < end){ //complete frames are processed
+		const char* q = p; uint64_t len;
+		if (! get_varint(q, end, len)) break;
+		if (len == 0 || len > max_frame) return false;
+		if ((uint64_t)(end - q) < len) break;
+		if (! frame(c, q, q + len)) return false;
+		p = q + len;
+	}
+	c.in.erase(0, p - c.in.data());
+	return ! eof;
+}
+
+bool fleet_collector::frame(client& c, const char* p, const char* end){
+	char type = *p++; uint64_t id, count;
+	if (! get_varint(p, end, id) || id > 0xffff) return false;
+	if (type == 'B'){
+		string key = c.host + '/' + string(p, end);
+		unique_ptr<device>& d = devices[key];
+		if (! d) d.reset(new device(key + ": "));
+		if (c.devices.size() <= id) {c.devices.resize(id + 1, NULL); c.codecs.resize(id + 1);}
+		c.devices[id] = d.get(); c.codecs[id] = fleet_codec();
+		return true;
+	}
+	if ((type != 'R' && type != 'E') || id >= c.devices.size() || c.devices[id] == NULL) return false;
+	power_reading r;
+	if (type == 'E'){
+		device& d = *c.devices[id];
+		if (! c.codecs[id].decode(p, end, r)) return false;
+		if (! d.first && r.mtime >= d.preading.mtime && r.mtime - d.preading.mtime <= max_gap)
+			endsession(d, r.mtime - d.preading.mtime);
+		else if (! d.first) endsession(d, 0);
+		return p == end;
+	}
+	if (! get_varint(p, end, count)) return false;
+	for (uint64_t i = 0; i < count; i++){
+		if (! c.codecs[id].decode(p, end, r)) return false;
+		check(*c.devices[id], r);
+	}
+	return p == end;
+}
+
+// the same conditions of sessions as battery_monitor::check(), and also a long gap or a restart of the sender
+void fleet_collector::check(device& d, const power_reading& r){
+	double dtime = 0;
+	if (! d.first){
+		dtime = r.mtime - d.preading.mtime;
+		double slept = (r.slept > 0 && d.preading.slept > 0)? r.slept - d.preading.slept : 0;
+		bool gap = (dtime < 0 || dtime > max_gap);
+		if (r.charging != d.preading.charging || slept > 0.1 || gap || ! d.readings.accepts(r))
+			endsession(d, gap? 0 : dtime);
+	}
+	if (d.first){
+		d.stats.reset(!config.manualswitch || !r.charging);
+		d.readings.clear();
+		d.first = false; dtime = 0;
+	}
+	d.stats.add(r, dtime);
+	d.readings.push(r);
+	d.preading = r;
+}
+
+void fleet_collector::endsession(device& d, double dtime){
+	d.stats.end(dtime);
+	d.stats.flush();
+	if (d.stats.size() >= 5){
+		string strstat = stat_summary(d.stats, config, d.preading.charging, d.label);
+		report('\n' + strstat);
+		if (statlog) statlog.append(strstat + '\n');
+	}
+	d.first = true;
+}
+
+void fleet_collector::drop(int fd){
+	map<int, client>::iterator it = clients.find(fd);
+	if (it != clients.end() && it->second.hello) report(it->second.host + " disconnected.\n");
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+	clients.erase(fd);
+}
+
+int collect(const string& address){
+	setworkingfolder();
+	if (! readconfig(false)) config = poweralarmconfig(); //defaults, for the statistics
+	
+	// each sender is a connection, the limit of open files is raised as far as it is allowed
+	rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max){
+		rl.rlim_cur = rl.rlim_max; setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	signal(SIGTERM, daemon_signal_handler); signal(SIGINT, daemon_signal_handler);
+	signal(SIGPIPE, SIG_IGN);
+	
+	fleet_collector collector;
+	if (! collector.listenon(address)) {cout << "Error: Failed to listen on " << address << ".\n"; return 1;}
+	cout << "collecting readings on " << address << ", press Ctrl+C to end.\n";
+	collector.run();
+	return 0;
+}
+
+// the output thread: statistics, console output and logs, so that a slow terminal or disk
+// doesn't delay the sampling. it's woken up by wakefd (an eventfd) after each tick,
+// and it serves the query socket while waiting, if there is one.
+void outputloop(vector<unique_ptr<battery_monitor>>& monitors, spsc_queue<sample_msg>& queue, int wakefd,
+                query_server* server, fleet_sender* fleet){
+	sample_msg msg; uint64_t cnt;
+	uint64_t pdropped = 0; double droppedmtime = -60; //of the latest warning about dropped readings
+	while (true){
+		bool checked = false;
+		uint64_t dropped = overhead.dropped.load(memory_order_relaxed);
+		if (dropped > pdropped && monotonic_now() - droppedmtime >= 60){ //at most once a minute
+			report("Warning: the output was late, " + to_string(dropped - pdropped) + " readings were dropped.\n");
+			pdropped = dropped; droppedmtime = monotonic_now();
+		}
+		while (queue.pop(msg)){
+			if (msg.command == 'o'){
+				report("overhead (stages: count, mean, p50, p99, max in µs):\n" + overhead.usrstr());
+				continue;
+			}
+			if (msg.command == 'r'){ //readings before it were checked with the old config
+				if (msg.battery < monitors.size()) monitors[msg.battery]->apply(*msg.config);
+				else statlog.setpolicy(*msg.config);
+				delete msg.config;
+				continue;
+			}
+			if (msg.command != '\0'){
+				for (unsigned int i = 0; i < monitors.size(); i++)
+					monitors[i]->savelog = (msg.command == 'l');
+				continue;
+			}
+			monitors[msg.battery]->check(msg.reading, msg.alarm, msg.notify, msg.ir, msg.exiting);
+			if (fleet) fleet->add(msg.battery, msg.reading, msg.exiting);
+			checked = true;
+			if (msg.exiting && msg.battery == monitors.size() - 1){ //the last item
+				if (fleet) fleet->finish();
+				return;
+			}
+		}
+		uint64_t t0 = monotonic_ns();
+		cout.flush();
+		uint64_t t1 = monotonic_ns();
+		statlog.flush();
+		if (checked && ! daemon_mode) overhead.stages[overhead_monitor::stage_flush].record(t1 - t0);
+		if (checked && statlog) overhead.stages[overhead_monitor::stage_logflush].record(monotonic_ns() - t1);
+		if (server && checked) server->render(monitors);
+		if (fleet && checked) fleet->flush(false);
+		if (server) server->wait(monitors);
+		else if (read(wakefd, &cnt, sizeof(cnt)) < 0 && errno != EINTR) return;
+		overhead.outputwakeups.fetch_add(1, memory_order_relaxed);
+	}
+}
+
+// hot reload, by the sampling thread on SIGHUP (daemon mode) or a change of the config file. keys of
+// copy_reloadable() take effect at once, the others are kept until the program restarts. the configs are
+// handed to the output thread through the queue, in order with the readings, so no thread takes a lock.
+bool reloadconfig(vector<unique_ptr<battery_monitor>>& monitors, spsc_queue<sample_msg>& queue, int wakefd){
+	poweralarmconfig def; vector<poweralarmconfig> sections; string errors;
+	if (! loadconfig(def, sections, &errors)){
+		report("Warning: Failed to reload " + config_filename + ", the config is not changed.\n" + errors);
+		return false;
+	}
+	if (errors != "") report("Warning: ignored in " + config_filename + ":\n" + errors);
+	
+	// the globals are only used by this thread (and main() after it), later save_config_ir() only changes ir in the file
+	poweralarmconfig running = config;
+	config = def; battery_configs = sections;
+	copy_reloadable(running, def);
+	
+	sample_msg msg; const uint64_t one = 1;
+	msg.command = 'r'; msg.exiting = false;
+	for (msg.battery = 0; msg.battery <= monitors.size(); msg.battery++){
+		poweralarmconfig c = (msg.battery < monitors.size())? battery_config(monitors[msg.battery]->name()) : running;
+		if (msg.battery < monitors.size()) monitors[msg.battery]->reconfigure(c);
+		msg.config = new poweralarmconfig(c);
+		while (! queue.push(msg)) this_thread::yield();
+	}
+	write(wakefd, &one, sizeof(one));
+	report("config reloaded.\n");
+	return true;
+}
+
+// AdaptiveInterval: the next sample is taken when the earliest update of the gauges is expected. if an update
+// is late, the gauge is sampled every interval until it arrives, so the phase of the updates is followed.
+// a gauge which hasn't updated for a long time (e.g. full) is sampled at its period, not more often.
+double adaptivedelay(vector<unique_ptr<battery_monitor>>& monitors, double interval, double maxinterval){
+	double now = monotonic_now(), next = numeric_limits<double>::infinity();
+	for (unsigned int i = 0; i < monitors.size(); i++){
+		const gauge_cadence& g = monitors[i]->gauge();
+		double period = g.estimate();
+		if (period <= 0) return interval; //still unknown
+		double expected = g.last_change() + period;
+		if (expected <= now) expected = (now - expected <= period)? now + interval : now + period;
+		next = min(next, expected);
+	}
+	return max(interval, min(maxinterval, next - now));
+}
+
+// the CPUs of the least capacity among the allowed ones (efficiency cores of a hybrid or big.LITTLE processor),
+// by cpu_capacity (arm, riscv) or else cpuinfo_max_freq. returns false if they are all the same
+bool efficiency_cores(cpu_set_t& set){
+	cpu_set_t allowed; CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return false;
+	const char* attrs[] = {"cpu_capacity", "cpufreq/cpuinfo_max_freq"};
+	for (unsigned int a = 0; a < 2; a++){
+		long least = numeric_limits<long>::max(), most = 0; vector<long> values(CPU_SETSIZE, -1);
+		for (int i = 0; i < CPU_SETSIZE; i++){
+			if (! CPU_ISSET(i, &allowed)) continue;
+			ifstream ifs("/sys/devices/system/cpu/cpu" + to_string(i) + '/' + attrs[a]);
+			if (! (ifs >> values[i])) values[i] = -1;
+			else {least = min(least, values[i]); most = max(most, values[i]);}
+		}
+		if (most == 0) continue; //the attribute isn't available
+		if (least == most) return false;
+		for (int i = 0; i < CPU_SETSIZE; i++)
+			if (values[i] == least) CPU_SET(i, &set);
+		return true;
+	}
+	return false;
+}
+
+// GreenMode: this program runs on the battery it measures, so its own wakeups are reduced. it's called before
+// the output thread is created, which inherits the affinity. the other parts are in
+// checkloop(): the tick is aligned, the watchdog is pinged on ticks, and the output thread is woken late.
+void green_setup(){
+	cpu_set_t set;
+	if (efficiency_cores(set) && sched_setaffinity(0, sizeof(set), &set) == 0){
+		string cpus;
+		for (int i = 0; i < CPU_SETSIZE; i++) if (CPU_ISSET(i, &set)) cpus += ' ' + to_string(i);
+		report("green mode: running on efficiency cores (CPU" + cpus + ").\n");
+	}
+	if (! isatty(STDOUT_FILENO)) console_output = false; //the readings aren't formatted at all
+}
+
+bool checkloop(){
+	// in event-driven mode, uevents bring status changes immediately, and the timer can be slow
+	unique_ptr<uevent_listener> uevents;
+	bool eventdriven = config.eventdriven;
+	if (eventdriven) uevents.reset(new uevent_listener());
+	if (eventdriven && ! *uevents){
+		cout << "Warning: Failed to listen to uevents, Sample Interval is used instead of Idle Interval.\n";
+		eventdriven = false;
+	}
+	double period = eventdriven? config.idleinterval : config.interval;
+	
+	vector<unique_ptr<battery_monitor>> monitors; //creates readers
+	vector<string> devicepaths = find_power_supplies();
+	for (unsigned int i = 0; i < devicepaths.size(); i++){
+		string path = devicepaths[i];
+		string name = path.substr(0, path.length() - 1); name = name.substr(name.rfind('/') + 1);
+		monitors.emplace_back(new battery_monitor(path, battery_config(name), devicepaths.size() > 1, period));
+		if (! *monitors.back()) monitors.pop_back();
+	}
+	if (monitors.empty()) {cout << "Error: Failed to read power status. Press Ctrl+D or Input 'e' to end program... "; return false;}
+	
+	unique_ptr<sysfs_ring> ring; //IOUring
+	if (config.iouring){
+		ring.reset(new sysfs_ring((4 + tele_count) * monitors.size()));
+		bool ok = *ring;
+		for (unsigned int i = 0; i < monitors.size() && ok; i++) ok = monitors[i]->attach(ring.get());
+		if (! ok || ! ring->registerfiles()){
+			cout << "Warning: io_uring isn't available, the batteries are read by pread().\n";
+			for (unsigned int i = 0; i < monitors.size(); i++) monitors[i]->attach(NULL);
+			ring.reset();
+		}
+	}
+	
+	sample_scheduler ticker(period);
+	if (! ticker) {cout << "Error: Failed to create timer. Press Ctrl+D or Input 'e' to end program... "; return false;}
+	if (eventdriven) ticker.watch(uevents->fd());
+	ticker.watch(commands.fd());
+	bool green = config.greenmode, adaptive = config.adaptiveinterval && ! eventdriven;
+	if (green) {green_setup(); ticker.align(period);}
+	
+	// the watchdog timer is separated from the sampling timer, which may be much slower in event-driven mode.
+	// in green mode, the ticks ping it if they are frequent enough (a reload isn't expected to slow them down)
+	double watchdogperiod = sd_watchdog_period();
+	bool pingontick = green && watchdogperiod > 0 && (adaptive? config.idleinterval : period) <= watchdogperiod;
+	unique_ptr<sample_scheduler> watchdog;
+	if (watchdogperiod > 0 && ! pingontick) watchdog.reset(new sample_scheduler(watchdogperiod));
+	if (watchdog && *watchdog) ticker.watch(watchdog->fd());
+	
+	int wakefd = eventfd(0, EFD_CLOEXEC);
+	if (wakefd < 0) {cout << "Error: Failed to create eventfd. Press Ctrl+D or Input 'e' to end program... "; return false;}
+	spsc_queue<sample_msg> queue(0x1000);
+	
+	unique_ptr<query_server> server(new query_server(wakefd)); //created here, for it checks the environment
+	if ((config.querysocket != "" || getenv("LISTEN_FDS") != NULL) && ! server->listenunix(config.querysocket))
+		cout << "Warning: Failed to create the query socket.\n";
+	if (config.metricslisten != "" && ! server->listenhttp(config.metricslisten))
+		cout << "Warning: Failed to listen on " << config.metricslisten << " for metrics.\n";
+	if (! *server) server.reset();
+	if (! statlog.open(stat_filename, config, true))
+		cout << "Warning: Failed to open " << working_folder << '/' << stat_filename << ".\n";
+	unique_ptr<fleet_sender> fleet;
+	if (config.fleetcollector != ""){
+		vector<string> names;
+		for (unsigned int i = 0; i < monitors.size(); i++) names.push_back(monitors[i]->name());
+		fleet.reset(new fleet_sender(config.fleetcollector, names, config.fleetbatch));
+	}
+	thread threadoutput(outputloop, ref(monitors), ref(queue), wakefd, server.get(), fleet.get());
+	sd_notify_state("READY=1");
+	overhead.start();
+	double psuspended = suspended_now();
+	
+	config_watcher watcher;
+	if (watcher) ticker.watch(watcher.fd());
+	
+	sample_msg msg; const uint64_t one = 1;
+	msg.config = NULL;
+	bool exiting = false, charging = false; //charging: manual setting
+	
+	// in green mode without console output, the output thread is woken only by alarms, changes of the status,
+	// commands and every IdleInterval (or when the queue fills up), instead of on every tick
+	bool deferred = green && (daemon_mode || ! console_output);
+	vector<uint8_t> palarms(monitors.size(), 0); vector<char> pcharging(monitors.size(), -1);
+	double wokenmtime = monotonic_now(); size_t unchecked = 0;
+	while (true){
+		msg.command = '\0';
+		// one batched pass over all batteries per tick, so the readings are taken at nearly the same moment.
+		// in case of the queue is full (the output thread is blocked), readings are dropped,
+		// except the last ones which end the sessions.
+		msg.exiting = exiting;
+		// the scans of an IIO buffer are all passed, except when exiting, as only one reading ends the session
+		bool urgent = exiting || ! deferred;
+		if (ring){ //the reads of all batteries in one syscall
+			for (unsigned int i = 0; i < monitors.size(); i++) monitors[i]->prefetch();
+			ring->submit();
+		}
+		for (msg.battery = 0; msg.battery < monitors.size(); msg.battery++) do {
+			msg.reading = monitors[msg.battery]->sample(charging, msg.alarm, msg.notify);
+			msg.ir = monitors[msg.battery]->resistance_used();
+			if (! exiting && monitors[msg.battery]->coalesced()) continue; //a duplicate reading
+			while (! queue.push(msg)){
+				if (! exiting){
+					overhead.dropped.fetch_add(1, memory_order_relaxed); //warned by outputloop()
+					if (monitors[msg.battery]->scanned()) overhead.droppedscans.fetch_add(1, memory_order_relaxed);
+					break;
+				}
+				this_thread::yield();
+			}
+			unchecked++;
+			if (msg.notify || msg.alarm != palarms[msg.battery] || msg.reading.charging != pcharging[msg.battery]) urgent = true;
+			palarms[msg.battery] = msg.alarm; pcharging[msg.battery] = msg.reading.charging;
+		} while (! exiting && monitors[msg.battery]->pending());
+		if (urgent || unchecked >= 0x400 || monotonic_now() - wokenmtime >= config.idleinterval){
+			write(wakefd, &one, sizeof(one)); //wakes up the output thread
+			wokenmtime = monotonic_now(); unchecked = 0;
+		}
+		
+		if (exiting) break;
+		if (adaptive) ticker.reschedule(adaptivedelay(monitors, config.interval, config.idleinterval), config.interval);
+		
+		// wait for next tick, unless power_supply uevents or commands which need a sample arrive earlier.
+		// uevents of other subsystems are dropped without taking a sample.
+		bool now = false; char cmd;
+		while (! now){
+			unsigned long ticks = ticker.wait();
+			overhead.samplingwakeups.fetch_add(1, memory_order_relaxed);
+			now = (ticks > 0);
+			if (now){ //expirations during suspend aren't missed by the program
+				double suspended = suspended_now();
+				if (ticks > 1 && suspended - psuspended < period) overhead.missed.fetch_add(ticks - 1, memory_order_relaxed);
+				psuspended = suspended;
+				if (pingontick) sd_notify_state("WATCHDOG=1");
+			}
+			if (watchdog && ticker.readable(watchdog->fd()) && watchdog->wait() > 0)
+				sd_notify_state("WATCHDOG=1"); //the sampling thread is alive
+			if (eventdriven && ticker.readable(uevents->fd()) && uevents->receive()) now = true;
+			bool reload = (watcher && ticker.readable(watcher.fd()) && watcher.changed());
+			while (ticker.readable(commands.fd()) && commands.receive(cmd))
+				switch (cmd){
+					case 'e':
+						exiting = now = true; break;
+					case 'c': case 'd':
+						if (charging != (cmd == 'c')) now = true; //the session ends immediately
+						charging = (cmd == 'c'); break;
+					case 'l': case 'n': case 'o':
+						msg.command = cmd;
+						while (! queue.push(msg)) this_thread::yield();
+						write(wakefd, &one, sizeof(one));
+						msg.command = '\0';
+						break;
+					case 'r':
+						reload = true;
+				}
+			if (reload && reloadconfig(monitors, queue, wakefd)){
+				double p = eventdriven? config.idleinterval : config.interval;
+				if (p != period) {period = p; ticker.reschedule(period, period); if (green) ticker.align(period);}
+			}
+		}
+	}
+	
+	sd_notify_state("STOPPING=1");
+	threadoutput.join();
+	close(wakefd);
+	statlog.close();
+	
+	// estimated internal resistances are saved for the next run
+	bool irchanged = false;
+	for (unsigned int i = 0; i < monitors.size(); i++){
+		float r = monitors[i]->resistance();
+		if (r <= 0) continue;
+		set_battery_ir(monitors[i]->name(), r); irchanged = true;
+		report("estimated internal resistance of " + monitors[i]->name() + ": " + float_str(r) + " Ω.\n");
+	}
+	if (irchanged && ! save_config_ir())
+		report("Warning: Failed to save the estimated internal resistance.\n");
+	return true;
+}
+
+void inputloop(){
+	string str;
+	const bool manualswitch = config.manualswitch; //config may be reloaded by the sampling thread
+	
+	cout << "press Ctrl+D or input 'e' to end the program, input 'l' to enable/disable complete log saving, "
+	     << "input 'o' to show the overhead of this program";
+	if (manualswitch)
+		cout << ", input 'c'(charging) or 'd'(discharging) to set charging status (nessesary, it should be right after you plug in or pull out the charge line).\n"
+			 << "Notice: to avoid disturbing, this program determines "
+			 << "whether or not to make alarm sound by your manual status setting.\n\n";
+	else cout << ".\n\n";
+	
+	bool savelog = savelog_default;
+	while (cin >> str){
+		char f = tolower(str.c_str()[0]);
+		switch (f){
+			case 'e':
+				commands.send('e'); return;
+			case 'c': case 'd':
+				if (manualswitch) commands.send(f);
+				break;
+			case 'l':
+				savelog = ! savelog;
+				commands.send(savelog? 'l' : 'n');
+				cout << "Log Saving " << (savelog? "Enabled" : "Disabled") << ".\n";
+				break;
+			case 'o':
+				commands.send('o');
+		}
+	}
+	
+	commands.send('e'); // Ctrl+D pressed, input ended
+}
+
+// replay mode (-r): saved logs are streamed through alarm_engine and session_stats at full speed, with the
+// thresholds of the config, which can be overridden by KEY=VALUE parameters. E is recomputed only if
+// InternalResistance is overridden. files are processed in parallel, each one is a session.
+class replay_source {
+	int fd; const char* map; size_t mapsize;
+	const char* p; const char* end; //position of the next record or line
+	bool binary; binary_log_header header;
+	bool charging; //of text logs, by the file name
+	char hourprefix[13]; time_t hourtime; //cache of mktime(), see parsetime()
+	
+	bool parsetime(const char* s, time_t& t);
+public:
+	replay_source(const string& filename);
+	replay_source(const replay_source&) = delete;
+	~replay_source();
+	operator const bool() const;
+	
+	bool isbinary() const;
+	const binary_log_header& binaryheader() const;
+	bool next(power_reading& r); //returns false at the end
+};
+
+static const char* parse_float(const char* p, const char* end, float& v){ //returns NULL if it's not a number
+	bool neg = false; double x = 0, scale = 1; bool digits = false;
+	if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+	for (; p < end && *p >= '0' && *p <= '9'; p++) {x = x * 10 + (*p - '0'); digits = true;}
+	if (p < end && *p == '.')
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++) {scale /= 10; x += (*p - '0') * scale; digits = true;}
+	if (! digits) return NULL;
+	v = neg? -x : x;
+	return p;
+}
+
+static bool match(const char*& p, const char* end, const char* s){ //skips s if it is at p
+	const char* q = p;
+	for (; *s; s++, q++) if (q >= end || *q != *s) return false;
+	p = q; return true;
+}
+
+replay_source::replay_source(const string& filename):
+	fd(-1), map(NULL), mapsize(0), p(NULL), end(NULL), binary(false), charging(false), hourtime(0) {
+	memset(hourprefix, 0, sizeof(hourprefix));
+	fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) return;
+	mapsize = st.st_size;
+	void* m = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m == MAP_FAILED) {mapsize = 0; return;}
+	map = (const char*)m; p = map; end = map + mapsize;
+	madvise(m, mapsize, MADV_SEQUENTIAL);
+	
+	if (mapsize >= sizeof(binary_log_header) && memcmp(map, "SBVALOG", 8) == 0){
+		memcpy(&header, map, sizeof(header));
+		binary = (header.version == binary_log_header::current_version && header.recordsize == sizeof(packed_reading));
+		if (! binary) {p = end; return;} //unknown version
+		p = map + sizeof(binary_log_header);
+		size_t count = min((size_t)header.count, (mapsize - sizeof(binary_log_header)) / sizeof(packed_reading));
+		end = p + count * sizeof(packed_reading);
+	} else {
+		size_t slash = filename.rfind('/');
+		charging = filename.compare((slash == string::npos)? 0 : slash + 1, 9, "Charging_") == 0;
+	}
+}
+
+replay_source::~replay_source(){
+	if (map) munmap((void*)map, mapsize);
+	if (fd >= 0) close(fd);
+}
+
+replay_source::operator const bool() const{
+	return (map != NULL);
+}
+
+bool replay_source::isbinary() const{
+	return binary;
+}
+
+const binary_log_header& replay_source::binaryheader() const{
+	return header;
+}
+
+bool replay_source::parsetime(const char* s, time_t& t){ //"YYYY-MM-DD HH:MM:SS", in local time
+	for (int i = 0; i < 19; i++){
+		bool digit = (s[i] >= '0' && s[i] <= '9');
+		if (digit != (i != 4 && i != 7 && i != 10 && i != 13 && i != 16)) return false;
+	}
+	if (memcmp(s, hourprefix, 13) != 0){ //mktime() is called once per hour of readings
+		tm st; memset(&st, 0, sizeof(st));
+		st.tm_year = atoi(s) - 1900; st.tm_mon = atoi(s + 5) - 1; st.tm_mday = atoi(s + 8);
+		st.tm_hour = atoi(s + 11); st.tm_isdst = -1;
+		hourtime = mktime(&st);
+		memcpy(hourprefix, s, 13);
+	}
+	t = hourtime + atoi(s + 14) * 60 + atoi(s + 17);
+	return true;
+}
+
+bool replay_source::next(power_reading& r){
+	if (binary){
+		if (p >= end) return false;
+		packed_reading rec; memcpy(&rec, p, sizeof(rec)); p += sizeof(rec);
+		r = rec.unpack(header.basetime, header.basemtime);
+		return true;
+	}
+	
+	// a line of power_reading::format(), other lines are skipped
+	while (p < end){
+		const char* line = p;
+		const char* eol = (const char*)memchr(p, '\n', end - p);
+		if (eol == NULL) eol = end;
+		p = (eol < end)? eol + 1 : end;
+		
+		time_t t;
+		if (eol - line < 30 || ! parsetime(line, t)) continue;
+		const char* q = line + 19;
+		bool c = charging, full = false;
+		while (q < eol && *q == ' ') q++;
+		if (match(q, eol, "Full ")) c = full = true;
+		else if (match(q, eol, "Charging ")) c = true;
+		else if (match(q, eol, "Discharging ")) c = false;
+		while (q < eol && *q == ' ') q++;
+		
+		float v, e, i, cp = -1;
+		const char* n = parse_float(q, eol, v);
+		if (n && match(n, eol, "%, ")) {cp = v; n = parse_float(n, eol, v);}
+		if (! n || ! match(n, eol, " V")) continue; //the time range line of the statistics
+		e = v;
+		if (match(n, eol, " (E: ") && ! ((n = parse_float(n, eol, e)) && match(n, eol, " V)"))) continue;
+		if (! match(n, eol, ", ") || ! (n = parse_float(n, eol, i))) continue;
+		
+		r = power_reading(t, t, c, full, v, i, e, (int)cp);
+		return true;
+	}
+	return false;
+}
+
+struct replay_result {
+	string text;
+	size_t readings, notifications;
+	double alarmtime; //(s) of active alarms
+};
+
+replay_result replay_file(const string& filename, const vector<string>& overrides, bool setir){
+	replay_result res; res.readings = res.notifications = 0; res.alarmtime = 0;
+	replay_source src(filename);
+	if (! src) {res.text = filename + ": can't be read.\n"; return res;}
+	
+	// the config of binary logs is written in their headers
+	poweralarmconfig cfg = config;
+	if (src.isbinary()){
+		const binary_log_header& h = src.binaryheader();
+		cfg = battery_config(string(h.battery, strnlen(h.battery, sizeof(h.battery))));
+		cfg.ir = h.ir; cfg.minvoltage = h.minvoltage; cfg.maxvoltage = h.maxvoltage;
+		cfg.maxpower = h.maxpower; cfg.manualswitch = h.manualswitch;
+	}
+	for (unsigned int i = 0; i < overrides.size(); i++){
+		size_t eq = overrides[i].find('=');
+		istringstream iss("= " + overrides[i].substr(eq + 1));
+		read_config_key(iss, overrides[i].substr(0, eq), cfg);
+	}
+	
+	alarm_engine alarms(cfg, numeric_limits<float>::max()); //the design max voltage isn't logged
+	session_stats stats;
+	power_reading r, p; bool first = true; uint8_t palarm = 0;
+	while (src.next(r)){
+		if (setir) r.E = (cfg.manualswitch && r.charging)? r.voltage : r.voltage - r.current * cfg.ir;
+		bool actuald = !r.charging || (!cfg.manualswitch && r.current < 0);
+		if (alarms.evaluate(r, actuald)) res.notifications++;
+		
+		double dtime = first? 0 : r.mtime - p.mtime;
+		if (first) {stats.reset(!cfg.manualswitch || !r.charging); first = false;}
+		stats.add(r, dtime);
+		if (palarm) res.alarmtime += dtime;
+		palarm = alarms.active(); p = r; res.readings++;
+	}
+	stats.end(0); stats.flush();
+	
+	if (stats.count < 2 || stats.duration <= 0) {res.text = filename + ": no readings.\n"; return res;}
+	res.text = filename + ":\n" + stat_summary(stats, cfg, p.charging, "")
+	         + "Alarms: " + to_string(res.notifications) + " (" + difftime_str((time_t)res.alarmtime) + ")\n";
+	return res;
+}
+
+int replay(const vector<string>& args){
+	setworkingfolder();
+	if (! readconfig(false)) config = poweralarmconfig(); //defaults
+	
+	vector<string> files, overrides; bool setir = false;
+	for (unsigned int i = 0; i < args.size(); i++){
+		size_t eq = args[i].find('=');
+		if (eq == string::npos) {files.push_back(args[i]); continue;}
+		poweralarmconfig test; istringstream iss("= " + args[i].substr(eq + 1));
+		string key = args[i].substr(0, eq);
+		if (! read_config_key(iss, key, test) || ! iss) {cout << "Error: invalid parameter " << args[i] << ".\n"; return 1;}
+		if (key == "InternalResistance") setir = true;
+		overrides.push_back(args[i]);
+	}
+	if (files.empty()) {cout << "Error: no log file is given.\n"; return 1;}
+	
+	vector<replay_result> results(files.size());
+	atomic<size_t> nextfile(0);
+	unsigned int nthreads = max(1u, min((unsigned int)files.size(), thread::hardware_concurrency()));
+	vector<thread> workers;
+	for (unsigned int t = 0; t < nthreads; t++)
+		workers.emplace_back([&]{
+			for (size_t i; (i = nextfile.fetch_add(1)) < files.size(); )
+				results[i] = replay_file(files[i], overrides, setir);
+		});
+	for (unsigned int t = 0; t < workers.size(); t++) workers[t].join();
+	
+	size_t readings = 0, notifications = 0; double alarmtime = 0;
+	for (unsigned int i = 0; i < results.size(); i++){
+		cout << results[i].text << '\n';
+		readings += results[i].readings; notifications += results[i].notifications; alarmtime += results[i].alarmtime;
+	}
+	cout << files.size() << " files, " << readings << " readings, " << notifications << " alarms ("
+	     << difftime_str((time_t)alarmtime) << ").\n";
+	return 0;
+}
+
+// health report (-s [DAYS] [BAT]): monthly means of the sessions ended in the latest DAYS (default 365) from
+// the health database, and the trend of the full capacity estimation (least squares over time)
+int health_report(const vector<string>& args){
+	setworkingfolder();
+	double days = 365; string battery;
+	for (unsigned int i = 0; i < args.size(); i++){
+		char* end; double d = strtod(args[i].c_str(), &end);
+		if (*end == '\0' && d > 0) days = d; else battery = args[i];
+	}
+	health_database db;
+	if (! db.open(health_filename, false)) {cout << "Error: failed to open " << working_folder << '/' << health_filename << ".\n"; return 1;}
+	
+	map<string, vector<health_record>> batteries; //the range is found without reading older records
+	for (size_t i = db.lower_bound(time(NULL) - (int64_t)(days * 86400)); i < db.size(); i++){
+		health_record h = db.at(i); h.battery[sizeof(h.battery) - 1] = '\0';
+		if (battery == "" || battery == h.battery) batteries[h.battery].push_back(h);
+	}
+	if (batteries.empty()) {cout << "no sessions in the latest " << float_str(days, 0) << " days.\n"; return 0;}
+	
+	for (map<string, vector<health_record>>::iterator it = batteries.begin(); it != batteries.end(); it++){
+		const vector<health_record>& hs = it->second;
+		cout << it->first << ": " << hs.size() << " sessions, " << time_str(hs.front().begin) << " ~ "
+		     << time_str(hs.back().end) << '\n'
+		     << "month    sessions  full Wh   full mAh  ir (Ω)  discharge W  out of range\n";
+		
+		double n = 0, st = 0, sc = 0, stt = 0, stc = 0; //of the fit, t in days since the first estimation
+		double t0 = 0;
+		for (size_t i = 0; i < hs.size(); ){
+			char month[8]; tm tmend; time_t tend = hs[i].end;
+			localtime_r(&tend, &tmend); strftime(month, sizeof(month), "%Y-%m", &tmend);
+			size_t count = 0, nfull = 0, ndis = 0; double Wh = 0, mAh = 0, ir = 0, W = 0, outofrange = 0;
+			for (; i < hs.size(); i++){
+				tend = hs[i].end; localtime_r(&tend, &tmend);
+				char m[8]; strftime(m, sizeof(m), "%Y-%m", &tmend);
+				if (strcmp(m, month) != 0) break;
+				const health_record& h = hs[i];
+				count++; ir += h.ir; outofrange += h.outofrange;
+				if (! h.charging) {ndis++; W += h.W;}
+				if (h.fullWh <= 0) continue;
+				nfull++; Wh += h.fullWh; mAh += h.fullmAh;
+				if (n == 0) t0 = h.end;
+				double t = (h.end - t0) / 86400.0;
+				n++; st += t; sc += h.fullWh; stt += t*t; stc += t*h.fullWh;
+			}
+			cout << month << "  " << setw(8) << left << count << "  "
+			     << setw(8) << (nfull? float_str(Wh/nfull) : "-") << "  " << setw(8) << (nfull? float_str(mAh/nfull, 0) : "-")
+			     << "  " << setw(6) << float_str(ir/count) << "  " << setw(11) << (ndis? float_str(W/ndis) : "-")
+			     << "  " << to_string((int)round(outofrange/count)) << "%\n" << right;
+		}
+		double det = n*stt - st*st;
+		if (n >= 2 && det > 0){
+			double slope = (n*stc - st*sc) / det, mean = sc / n; //Wh per day
+			cout << "Full Capacity Estimation: " << float_str(mean) << " Wh on average, "
+			     << float_str(slope * 365 / mean * 100, 1, true) << "% per year (fit of " << (int)n << " sessions)\n";
+		} else
+			cout << "Full Capacity Estimation: too few sessions for a trend (capacity changed 5% at least)\n";
+		cout << '\n';
+	}
+	return 0;
+}
+
+// benchmark mode (-b [N]): costs of the sampling hot path per reading, on the real sysfs, on a fake tree
+// on tmpfs (/dev/shm), and on the same tree served from memory (sysfs_pread is replaced, no syscalls).
+// syscalls are counted by wrapping sysfs_pread, allocations by the replaced operator new.
+atomic<unsigned long> bench_preads(0);
+vector<string> bench_memory; //content of the files in memory, indexed by fd
+
+ssize_t counting_pread(int fd, void* buf, size_t count, off_t offset){
+	bench_preads.fetch_add(1, memory_order_relaxed);
+	return ::pread(fd, buf, count, offset);
+}
+
+ssize_t memory_pread(int fd, void* buf, size_t count, off_t offset){
+	if (fd < 0 || (size_t)fd >= bench_memory.size()) return -1;
+	const string& str = bench_memory[fd];
+	if ((size_t)offset >= str.length()) return 0;
+	size_t n = min(count, str.length() - offset);
+	memcpy(buf, str.data() + offset, n);
+	return n;
+}
+
+// caches the content of the attribute files of the device, for memory_pread()
+static void bench_load_memory(const string& devicepath){
+	const char* attrs[] = {"status", "voltage_now", "current_now", "capacity"};
+	bench_memory.clear();
+	for (unsigned int i = 0; i < 4; i++){ //fds are found by the path in /proc/self/fd
+		string path = devicepath + attrs[i]; char buf[64];
+		ifstream ifs(path); string content((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+		DIR* dr = opendir("/proc/self/fd"); struct dirent* p;
+		while (dr && (p = readdir(dr))){
+			string link = string("/proc/self/fd/") + p->d_name;
+			ssize_t n = readlink(link.c_str(), buf, sizeof(buf) - 1);
+			if (n <= 0) continue;
+			buf[n] = '\0';
+			char* real = realpath(path.c_str(), NULL);
+			if (real && strcmp(real, buf) == 0){
+				int fd = atoi(p->d_name);
+				if ((size_t)fd >= bench_memory.size()) bench_memory.resize(fd + 1);
+				bench_memory[fd] = content;
+			}
+			free(real);
+		}
+		if (dr) closedir(dr);
+	}
+}
+
+static void bench_backend(const string& label, const string& devicepath, bool memory, unsigned long n){
+	poweralarmconfig cfg;
+	battery_monitor monitor(devicepath, cfg, false, cfg.interval);
+	if (! monitor) {cout << label << "\tnot available\n"; return;}
+	power_status_reader reader(devicepath, cfg.manualswitch, cfg.ir);
+	if (memory) bench_load_memory(devicepath); //after the fds are opened
+	sysfs_pread = memory? memory_pread : counting_pread;
+	
+	bench_preads = 0; unsigned long allocs = allocation_count;
+	double t = (double)monotonic_ns();
+	for (unsigned long i = 0; i < n; i++) reader.read();
+	double readns = ((double)monotonic_ns() - t) / n;
+	double preads = (double)bench_preads / n, readallocs = (double)(allocation_count - allocs) / n;
+	
+	uint8_t alarm; bool notify;
+	t = (double)monotonic_ns();
+	for (unsigned long i = 0; i < n; i++) monitor.sample(false, alarm, notify);
+	double samplens = ((double)monotonic_ns() - t) / n;
+	
+	sysfs_pread = ::pread;
+	cout << label << '\t' << float_str(readns, 0) << "\t\t" << float_str(preads, 2) << "\t\t"
+	     << float_str(readallocs, 2) << "\t\t" << float_str(samplens, 0) << '\n';
+	if (memory) return;
+	
+	// the same reads in a batch of io_uring (IOUring), the syscalls are io_uring_enter() and fallback pread()
+	sysfs_ring ring(4);
+	if (! (ring && reader.attach(&ring) && ring.registerfiles())) {cout << label << "+io_uring\tnot available\n"; return;}
+	sysfs_pread = counting_pread;
+	bench_preads = 0; allocs = allocation_count;
+	t = (double)monotonic_ns();
+	for (unsigned long i = 0; i < n; i++) {reader.prefetch(); ring.submit(); reader.read();}
+	readns = ((double)monotonic_ns() - t) / n;
+	sysfs_pread = ::pread;
+	reader.attach(NULL);
+	cout << label << "+io_uring\t" << float_str(readns, 0) << "\t\t" << float_str((double)(bench_preads + ring.enters) / n, 2)
+	     << "\t\t" << float_str((double)(allocation_count - allocs) / n, 2) << "\t\t-\n";
+}
+
+int benchmark(unsigned long n){
+	if (n == 0) n = 100000;
+	count_allocations = true; //before other threads exist, see operator new
+	cout << "per reading, " << n << " readings:\n"
+	     << "backend\tread() (ns)\tsyscalls\tallocations\tsample() (ns, with alarms)\n";
+	
+	vector<string> devices = find_power_supplies();
+	if (! devices.empty()) bench_backend("sysfs", devices[0], false, n);
+	else cout << "sysfs\tno battery\n";
+	
+	// the fake tree, on tmpfs if it is available
+	char dir[] = "/dev/shm/sbva-bench-XXXXXX"; char dir2[] = "/tmp/sbva-bench-XXXXXX";
+	char* root = mkdtemp(dir);
+	if (root == NULL) root = mkdtemp(dir2);
+	if (root == NULL) {cout << "Error: Failed to create the fake tree.\n"; return 1;}
+	string devicepath = string(root) + "/BAT0/";
+	mkdir(devicepath.c_str(), S_IRWXU);
+	const char* files[][2] = {{"status", "Discharging\n"}, {"voltage_now", "3950000\n"}, {"current_now", "-850000\n"},
+	                          {"capacity", "77\n"}, {"technology", "Li-ion\n"}, {"voltage_max_design", "4350000\n"}};
+	for (unsigned int i = 0; i < 6; i++) {ofstream ofs(devicepath + files[i][0]); ofs << files[i][1];}
+	
+	bench_backend((root == dir)? "tmpfs" : "tmp", devicepath, false, n);
+	bench_backend("memory", devicepath, true, n);
+	
+	// the output thread, on a reading of the fake tree
+	power_status_reader reader(devicepath, false, 0.1);
+	power_reading r = reader.read();
+	char line[160]; volatile size_t len = 0;
+	unsigned long allocs = allocation_count;
+	double t = (double)monotonic_ns();
+	for (unsigned long i = 0; i < n; i++) len += r.format(line, line + sizeof(line)) - line;
+	double formatns = ((double)monotonic_ns() - t) / n, formatallocs = (double)(allocation_count - allocs) / n;
+	
+	allocs = allocation_count;
+	t = (double)monotonic_ns();
+	for (unsigned long i = 0; i < n; i++) len += r.usrstr().length();
+	double usrstrns = ((double)monotonic_ns() - t) / n, usrstrallocs = (double)(allocation_count - allocs) / n;
+	
+	session_stats stats; reading_history history(min<unsigned long>(n, history_capacity));
+	allocs = allocation_count;
+	t = (double)monotonic_ns();
+	for (unsigned long i = 0; i < n; i++){
+		r.mtime += 5;
+		stats.add(r, 5); history.push(r);
+	}
+	double statsns = ((double)monotonic_ns() - t) / n, statsallocs = (double)(allocation_count - allocs) / n;
+	
+	cout << "format()\t" << float_str(formatns, 0) << " ns, " << float_str(formatallocs, 2) << " allocations\n"
+	     << "usrstr()\t" << float_str(usrstrns, 0) << " ns, " << float_str(usrstrallocs, 2) << " allocations\n"
+	     << "statistics and history\t" << float_str(statsns, 0) << " ns, " << float_str(statsallocs, 2) << " allocations\n";
+	
+	for (unsigned int i = 0; i < 6; i++) unlink((devicepath + files[i][0]).c_str());
+	rmdir(devicepath.c_str()); rmdir(root);
+	return 0;
+}
+
+int main(int argc, char* argv[]){
+	// processing command parameters
+	bool reconfig = false;
+	if (argc > 1){
+		char c;
 		for (int i = 1; i < argc; i++){
-			if (argv[1][0] == '-' && strlen(argv[i]) == 2){
+			if (argv[i][0] == '-' && strlen(argv[i]) == 2){
 				c = argv[i][1];
 				switch (c){
 					case 'l':
-						tagsavelog = true; break;
+						savelog_default = true; break;
 					case 'c':
 						reconfig = true; break;
+					case 'd':
+						daemon_mode = true; break;
+					case 'r': //the rest are files and overrides
+						return replay(vector<string>(argv + i + 1, argv + argc));
+					case 'C':
+						if (i + 1 >= argc) {cout << "Error: -C needs ADDRESS:PORT.\n"; return 1;}
+						return collect(argv[i + 1]);
+					case 's': //the rest are days and the battery
+						return health_report(vector<string>(argv + i + 1, argv + argc));
+					case 'b':
+						return benchmark((i + 1 < argc)? strtoul(argv[i + 1], NULL, 10) : 0);
+					case 'p':
+						if (i + 1 < argc) {power_supply_root = argv[++i]; power_supply_root += '/';}
+						break;
 					case 'h':
-						cout << "-l\tEnable log saving\n" << "-c\tReconfigure\n";
+						cout << "-l\tEnable log saving\n" << "-c\tReconfigure\n"
+						     << "-d\tRun as a daemon (no console input, messages go to syslog)\n"
+						     << "-r FILE... [KEY=VALUE]...\tReplay saved logs with the config, or with overridden keys\n"
+						     << "-C ADDRESS:PORT\tCollect the readings of other instances (FleetCollector)\n"
+						     << "-s [DAYS] [BAT]\tReport the capacity trend of sessions in the latest DAYS (365)\n"
+						     << "-b [N]\tBenchmark the sampling with N readings\n"
+						     << "-p DIR\tRead power supplies in DIR instead of /sys/class/power_supply\n";
 						return 0;
 				}
 			}
@@ -661,12 +5018,24 @@ int main(int argc, char* argv[]){
 	
 	}
 	
+	if (reconfig && daemon_mode) {cout << "Error: -c can't be used with -d.\n"; return 1;}
 	if (reconfig){ // -c parameter was found
 		if (! setconfig()) return 1;
 	} else {
 		if (! getconfig()) return 1;
 	}
 	
+	if (daemon_mode){
+		// the program is stopped by SIGTERM (or SIGINT) instead of 'e', alarm commands are not waited for
+		openlog("simplevoltagealarm", LOG_PID, LOG_DAEMON);
+		signal(SIGTERM, daemon_signal_handler); signal(SIGINT, daemon_signal_handler);
+		signal(SIGHUP, reload_signal_handler);
+		signal(SIGCHLD, SIG_IGN); signal(SIGPIPE, SIG_IGN);
+		bool ok = checkloop();
+		closelog();
+		return ok? 0 : 1;
+	}
+	
 	thread threadinput(inputloop); //wait for input
 	threadinput.detach(); //now the thread object can be destroyed, but the thread will continue
 	checkloop();